@@ -0,0 +1,256 @@
+/* --------------------------------------------------------------------------------
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "CompiledExpression.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <locale>
+#include <sstream>
+
+static double absFunc(double x) { return std::fabs(x); }
+static double sqrtFunc(double x) { return std::sqrt(x); }
+static double squareFunc(double x) { return x * x; }
+static double expFunc(double x) { return std::exp(x); }
+static double logFunc(double x) { return std::log(x); }
+static double log10Func(double x) { return std::log10(x); }
+static double ceilFunc(double x) { return std::ceil(x); }
+static double floorFunc(double x) { return std::floor(x); }
+static double roundFunc(double x) { return std::round(x); }
+static double sinFunc(double x) { return std::sin(x); }
+static double cosFunc(double x) { return std::cos(x); }
+static double tanFunc(double x) { return std::tan(x); }
+static double asinFunc(double x) { return std::asin(x); }
+static double acosFunc(double x) { return std::acos(x); }
+
+static const std::map<std::string, double (*)(double)> &compiledFunctions()
+{
+    static const std::map<std::string, double (*)(double)> functions = {
+        {"abs", absFunc}, {"sqrt", sqrtFunc}, {"square", squareFunc}, {"exp", expFunc}, {"log", logFunc}, {"log10", log10Func},
+        {"ceil", ceilFunc}, {"floor", floorFunc}, {"round", roundFunc},
+        {"sin", sinFunc}, {"cos", cosFunc}, {"tan", tanFunc}, {"asin", asinFunc}, {"acos", acosFunc}
+    };
+    return functions;
+}
+
+bool CompiledExpression::compile(const std::string &expr, SymbolTable &symbols)
+{
+    clear();
+    Parser parser(expr, symbols, _code);
+    bool ok = parser.parseSum();
+    parser.skipSpace();
+    if(!ok || parser.pos != expr.size() || parser.maxStackSize > maxStackSize) {
+        clear();
+        return false;
+    }
+    for(const Instruction &instruction : _code) {
+        if(instruction.op == PushSymbol && std::find(_slots.begin(), _slots.end(), instruction.slot) == _slots.end())
+            _slots.push_back(instruction.slot);
+    }
+    _maxStackSize = parser.maxStackSize;
+    _isCompiled = true;
+    return true;
+}
+
+void CompiledExpression::clear()
+{
+    _isCompiled = false;
+    _code.clear();
+    _slots.clear();
+    _maxStackSize = 0;
+}
+
+double CompiledExpression::eval(const double *values) const
+{
+    double stack[maxStackSize];
+    int top = -1;
+    for(const Instruction &instruction : _code) {
+        switch(instruction.op) {
+            case PushConstant: stack[++top] = instruction.value; break;
+            case PushSymbol: stack[++top] = values[instruction.slot]; break;
+            case Add: --top; stack[top] += stack[top + 1]; break;
+            case Subtract: --top; stack[top] -= stack[top + 1]; break;
+            case Multiply: --top; stack[top] *= stack[top + 1]; break;
+            case Divide: --top; stack[top] /= stack[top + 1]; break;
+            case Power: --top; stack[top] = std::pow(stack[top], stack[top + 1]); break;
+            case Negate: stack[top] = -stack[top]; break;
+            case Function: stack[top] = instruction.func(stack[top]); break;
+        }
+    }
+    return top == 0 ? stack[0] : 0;
+}
+
+void CompiledExpression::Parser::skipSpace()
+{
+    while(pos < str.size() && std::isspace(static_cast<unsigned char>(str[pos])))
+        ++pos;
+}
+
+bool CompiledExpression::Parser::accept(char c)
+{
+    skipSpace();
+    if(pos < str.size() && str[pos] == c) {
+        ++pos;
+        return true;
+    }
+    return false;
+}
+
+bool CompiledExpression::Parser::acceptOperator(char c)
+{
+    if(accept(c))
+        return true;
+    if(pos + 1 < str.size() && str[pos] == '.' && str[pos + 1] == c) {
+        pos += 2;
+        return true;
+    }
+    return false;
+}
+
+void CompiledExpression::Parser::emit(OpCode op, int slot, double value, double (*func)(double))
+{
+    Instruction instruction;
+    instruction.op = op;
+    instruction.slot = slot;
+    instruction.value = value;
+    instruction.func = func;
+    code.push_back(instruction);
+    if(op == PushConstant || op == PushSymbol)
+        ++stackSize;
+    else if(op != Negate && op != Function)
+        --stackSize;
+    if(stackSize > maxStackSize)
+        maxStackSize = stackSize;
+}
+
+// sum: product (('+' | '-') product)*
+bool CompiledExpression::Parser::parseSum()
+{
+    if(!parseProduct())
+        return false;
+    while(true) {
+        if(accept('+')) {
+            if(!parseProduct()) return false;
+            emit(Add);
+        } else if(accept('-')) {
+            if(!parseProduct()) return false;
+            emit(Subtract);
+        } else {
+            return true;
+        }
+    }
+}
+
+// product: unary (('*' | '/') unary)*
+bool CompiledExpression::Parser::parseProduct()
+{
+    if(!parseUnary())
+        return false;
+    while(true) {
+        if(acceptOperator('*')) {
+            if(!parseUnary()) return false;
+            emit(Multiply);
+        } else if(acceptOperator('/')) {
+            if(!parseUnary()) return false;
+            emit(Divide);
+        } else {
+            return true;
+        }
+    }
+}
+
+// unary: ('-' | '+') unary | power
+// !!! A sign applied to a power (e.g. -x^2) is not compiled as its precedence is parser dependent.
+bool CompiledExpression::Parser::parseUnary(bool *isPower)
+{
+    bool operandIsPower = false;
+    if(accept('-')) {
+        if(!parseUnary(&operandIsPower) || operandIsPower) return false;
+        emit(Negate);
+        return true;
+    }
+    if(accept('+'))
+        return parseUnary(&operandIsPower) && !operandIsPower;
+    return parsePower(isPower ? isPower : &operandIsPower);
+}
+
+// power: primary ('^' unary)?
+// !!! Chained powers (e.g. x^y^z) are not compiled as their associativity is parser dependent.
+bool CompiledExpression::Parser::parsePower(bool *isPower)
+{
+    *isPower = false;
+    if(!parsePrimary())
+        return false;
+    if(acceptOperator('^')) {
+        bool exponentIsPower = false;
+        if(!parseUnary(&exponentIsPower) || exponentIsPower) return false;
+        skipSpace();
+        if(pos < str.size() && (str[pos] == '^' || (str[pos] == '.' && pos + 1 < str.size() && str[pos + 1] == '^'))) return false;
+        emit(Power);
+        *isPower = true;
+    }
+    return true;
+}
+
+// primary: number | name | function '(' sum ')' | '(' sum ')'
+bool CompiledExpression::Parser::parsePrimary()
+{
+    skipSpace();
+    if(pos >= str.size())
+        return false;
+    char c = str[pos];
+    if(c == '(') {
+        ++pos;
+        return parseSum() && accept(')');
+    }
+    if(std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && pos + 1 < str.size() && std::isdigit(static_cast<unsigned char>(str[pos + 1])))) {
+        size_t start = pos;
+        while(pos < str.size() && std::isdigit(static_cast<unsigned char>(str[pos]))) ++pos;
+        if(pos < str.size() && str[pos] == '.' && !(pos + 1 < str.size() && (str[pos + 1] == '*' || str[pos + 1] == '/' || str[pos + 1] == '^'))) {
+            ++pos;
+            while(pos < str.size() && std::isdigit(static_cast<unsigned char>(str[pos]))) ++pos;
+        }
+        if(pos < str.size() && (str[pos] == 'e' || str[pos] == 'E')) {
+            size_t mantissaEnd = pos++;
+            if(pos < str.size() && (str[pos] == '+' || str[pos] == '-')) ++pos;
+            if(pos < str.size() && std::isdigit(static_cast<unsigned char>(str[pos]))) {
+                while(pos < str.size() && std::isdigit(static_cast<unsigned char>(str[pos]))) ++pos;
+            } else {
+                pos = mantissaEnd;
+            }
+        }
+        // !!! Locale independent conversion (always '.' as the decimal point).
+        std::istringstream in(str.substr(start, pos - start));
+        in.imbue(std::locale::classic());
+        double value;
+        if(!(in >> value))
+            return false;
+        emit(PushConstant, -1, value);
+        return true;
+    }
+    if(std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+        size_t start = pos;
+        while(pos < str.size() && (std::isalnum(static_cast<unsigned char>(str[pos])) || str[pos] == '_')) ++pos;
+        std::string name = str.substr(start, pos - start);
+        skipSpace();
+        if(pos < str.size() && str[pos] == '(') {
+            auto it = compiledFunctions().find(name);
+            if(it == compiledFunctions().end())
+                return false; // Unsupported function or indexing.
+            ++pos;
+            if(!parseSum() || !accept(')'))
+                return false;
+            emit(Function, -1, 0, it->second);
+            return true;
+        }
+        auto it = symbols.find(name);
+        int slot = it != symbols.end() ? it->second : int(symbols.size());
+        if(it == symbols.end())
+            symbols[name] = slot;
+        emit(PushSymbol, slot);
+        return true;
+    }
+    return false;
+}
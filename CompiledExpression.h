@@ -0,0 +1,85 @@
+/* --------------------------------------------------------------------------------
+ * Scalar math expression compiled to a flat stack machine bytecode.
+ *
+ * Names in the expression are resolved once to slots in a shared symbol table,
+ * so that evaluation is a tight loop over the bytecode without any string work.
+ *
+ * Only an unambiguous scalar subset of the expression syntax is compiled:
+ * numbers, names, + - * / ^ (and .* ./ .^), unary +/-, parentheses and common
+ * single argument functions. compile() returns false for anything else
+ * (e.g. matrix expressions, indexing, -x^2, x^y^z), in which case the expression
+ * should be evaluated by a full expression parser instead.
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#ifndef __CompiledExpression_H__
+#define __CompiledExpression_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+class CompiledExpression
+{
+public:
+    typedef std::map<std::string, int> SymbolTable; // name -> slot
+
+    CompiledExpression() : _isCompiled(false), _maxStackSize(0) {}
+
+    // Compile expr, appending any new names to symbols. Returns false if expr could not be compiled.
+    bool compile(const std::string &expr, SymbolTable &symbols);
+    void clear();
+    bool isCompiled() const { return _isCompiled; }
+
+    // Symbol slots referred to by the expression.
+    const std::vector<int> &slots() const { return _slots; }
+
+    // Evaluate given the value of each symbol slot. !!! All slots() must be valid indexes into values.
+    double eval(const double *values) const;
+
+protected:
+    enum OpCode { PushConstant, PushSymbol, Add, Subtract, Multiply, Divide, Power, Negate, Function };
+
+    struct Instruction
+    {
+        OpCode op;
+        int slot;
+        double value;
+        double (*func)(double);
+    };
+
+    static const int maxStackSize = 32;
+
+    bool _isCompiled;
+    std::vector<Instruction> _code;
+    std::vector<int> _slots;
+    int _maxStackSize;
+
+    // Recursive descent parser state.
+    struct Parser
+    {
+        const std::string &str;
+        size_t pos;
+        SymbolTable &symbols;
+        std::vector<Instruction> &code;
+        int stackSize;
+        int maxStackSize;
+
+        Parser(const std::string &str, SymbolTable &symbols, std::vector<Instruction> &code) :
+        str(str), pos(0), symbols(symbols), code(code), stackSize(0), maxStackSize(0) {}
+
+        void skipSpace();
+        bool accept(char c);
+        bool acceptOperator(char c); // Also accepts element-wise .c
+        void emit(OpCode op, int slot = -1, double value = 0, double (*func)(double) = 0);
+        bool parseSum();
+        bool parseProduct();
+        bool parseUnary(bool *isPower = 0);
+        bool parsePower(bool *isPower);
+        bool parsePrimary();
+    };
+};
+
+#endif
@@ -0,0 +1,57 @@
+# ------------------------------------------------
+# User defined paths.
+QWT_PRF = /usr/local/Cellar/qwt/6.1.3_3/features/qwt.prf
+EIGEN_HEADERS = /usr/local/include/eigen3
+GSL_HEADERS = /usr/local/Cellar/gsl/1.16/include
+GSL_LIBS = /usr/local/Cellar/gsl/1.16/lib
+EIGENLAB_HEADERS = $$(HOME)/projects/EigenLab
+# ------------------------------------------------
+
+# Settings and simulation engine shared by the GUI (KineticModelBuilder.pro), command line (kmb-cli.pro) and benchmark (kmb-bench.pro) targets.
+
+# C++11
+CONFIG += c++11
+
+# compiler flags
+QMAKE_CFLAGS += -O3
+QMAKE_CXXFLAGS += -march=native
+
+# defines
+debug: DEFINES += DEBUG
+release: DEFINES += NDEBUG
+release: DEFINES += EIGEN_NO_DEBUG
+
+# arch
+macx: DEFINES += MACX
+linux: DEFINES += LINUX
+win32: DEFINES += WIN32
+win64: DEFINES += WIN64
+
+# Eigen
+INCLUDEPATH += $$EIGEN_HEADERS
+
+# Gnu Scientific Library (GSL)
+INCLUDEPATH += $$GSL_HEADERS
+LIBS += -L$${GSL_LIBS} -lgsl -lgslcblas
+
+# EigenLab
+INCLUDEPATH += $$EIGENLAB_HEADERS
+
+# Simulation engine files
+HEADERS += $$PWD/CompiledExpression.h
+SOURCES += $$PWD/CompiledExpression.cpp
+
+HEADERS += $$PWD/MarkovModel.h
+SOURCES += $$PWD/MarkovModel.cpp
+
+HEADERS += $$PWD/QObjectPropertyTreeSerializer.h
+SOURCES += $$PWD/QObjectPropertyTreeSerializer.cpp
+
+HEADERS += $$PWD/StimulusClampProtocol.h
+SOURCES += $$PWD/StimulusClampProtocol.cpp
+
+HEADERS += $$PWD/TaskGraph.h
+SOURCES += $$PWD/TaskGraph.cpp
+
+HEADERS += $$PWD/UserPrompts.h
+SOURCES += $$PWD/UserPrompts.cpp
@@ -4,14 +4,15 @@
  * -------------------------------------------------------------------------------- */
 
 #include "MarkovModel.h"
-#include "QObjectPropertyEditor.h"
+#include "UserPrompts.h"
 #include <algorithm>
+#include <array>
 #include <climits>
 #include <cmath>
 #include <stdexcept>
 #include <QFile>
-#include <QFileDialog>
 #include <QJsonDocument>
+#include <QRegularExpression>
 #include <QTextStream>
 #include <QVariantMap>
 
@@ -60,6 +61,42 @@ namespace MarkovModel
         return attrs;
     }
     
+    void addExprSymbols(const QString &expr, std::set<QString> &symbols)
+    {
+        static const QRegularExpression nameRegex("(?<![\\w.])[A-Za-z_]\\w*");
+        QRegularExpressionMatchIterator it = nameRegex.globalMatch(expr);
+        while(it.hasNext())
+            symbols.insert(it.next().captured());
+    }
+    
+    void StateLumping::init(const std::vector<int> &lumpedStateIndexes)
+    {
+        int numStates = lumpedStateIndexes.size();
+        this->lumpedStateIndexes.resize(numStates);
+        std::map<int, int> renumbered;
+        std::vector<int> numMembers;
+        for(int i = 0; i < numStates; ++i) {
+            auto it = renumbered.insert(std::make_pair(lumpedStateIndexes[i], int(renumbered.size()))).first;
+            this->lumpedStateIndexes[i] = it->second;
+            if(it->second == int(numMembers.size()))
+                numMembers.push_back(0);
+            ++numMembers[it->second];
+        }
+        int numLumpedStates = numMembers.size();
+        std::vector<Eigen::Triplet<double> > lumpingTriplets, unlumpingTriplets;
+        lumpingTriplets.reserve(numStates);
+        unlumpingTriplets.reserve(numStates);
+        for(int i = 0; i < numStates; ++i) {
+            int I = this->lumpedStateIndexes[i];
+            lumpingTriplets.push_back(Eigen::Triplet<double>(i, I, 1));
+            unlumpingTriplets.push_back(Eigen::Triplet<double>(I, i, 1.0 / numMembers[I]));
+        }
+        lumpingMatrix.resize(numStates, numLumpedStates);
+        lumpingMatrix.setFromTriplets(lumpingTriplets.begin(), lumpingTriplets.end());
+        unlumpingMatrix.resize(numLumpedStates, numStates);
+        unlumpingMatrix.setFromTriplets(unlumpingTriplets.begin(), unlumpingTriplets.end());
+    }
+    
     State::~State()
     {
         if(MarkovModel *model = qobject_cast<MarkovModel*>(parent())) {
@@ -98,14 +135,11 @@ namespace MarkovModel
         stateIndexPairs10.clear();
         int mask = (1 << elementIndex);
         for(int from = 0; from < numStates; ++from) {
-            for(int to = 0; to < numStates; ++to) {
-                if((from ^ to) == mask) {
-                    if(to & mask)
-                        stateIndexPairs01.push_back(StateIndexPair(from, to));
-                    else
-                        stateIndexPairs10.push_back(StateIndexPair(from, to));
-                }
-            }
+            int to = from ^ mask;
+            if(to & mask)
+                stateIndexPairs01.push_back(StateIndexPair(from, to));
+            else
+                stateIndexPairs10.push_back(StateIndexPair(from, to));
         }
     }
     
@@ -169,22 +203,12 @@ namespace MarkovModel
             int configA = (from >> elementIndexA) & 1;
             int configB = (from >> elementIndexB) & 1;
             if(configA == 1 && configB == 1) {
-                for(int to = 0; to < numStates; ++to) {
-                    if((from ^ to) == maskA)
-                        stateIndexPairs1101.push_back(StateIndexPair(from, to));
-                    else if((from ^ to) == maskB)
-                        stateIndexPairs1110.push_back(StateIndexPair(from, to));
-                }
+                stateIndexPairs1101.push_back(StateIndexPair(from, from ^ maskA));
+                stateIndexPairs1110.push_back(StateIndexPair(from, from ^ maskB));
             } else if(configA == 1) {
-                for(int to = 0; to < numStates; ++to) {
-                    if((from ^ to) == maskB)
-                        stateIndexPairs1011.push_back(StateIndexPair(from, to));
-                }
+                stateIndexPairs1011.push_back(StateIndexPair(from, from ^ maskB));
             } else if(configB == 1) {
-                for(int to = 0; to < numStates; ++to) {
-                    if((from ^ to) == maskA)
-                        stateIndexPairs0111.push_back(StateIndexPair(from, to));
-                }
+                stateIndexPairs0111.push_back(StateIndexPair(from, from ^ maskA));
             }
         }
     }
@@ -312,41 +336,173 @@ namespace MarkovModel
                     StateGroup::getStateIndexes(group->states(), stateNames, group->stateIndexes);
             }
         }
+        // Compile expressions.
+        _compiledSymbols.clear();
+        foreach(Variable *variable, variables)
+            compileExpr(variable->valueExpr, variable->value());
+        foreach(State *state, findChildren<State*>(QString(), Qt::FindDirectChildrenOnly)) {
+            compileExpr(state->probabilityExpr, state->probability());
+            compileExprMap(state->attributeExprs, state->attributeExprsStr, state->attributes());
+        }
+        foreach(Transition *transition, findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly)) {
+            compileExpr(transition->rateExpr, transition->rate());
+            compileExpr(transition->chargeExpr, transition->charge());
+        }
+        foreach(BinaryElement *binaryElement, binaryElements) {
+            compileExpr(binaryElement->probability0Expr, binaryElement->probability0());
+            compileExpr(binaryElement->rate01Expr, binaryElement->rate01());
+            compileExpr(binaryElement->rate10Expr, binaryElement->rate10());
+            compileExpr(binaryElement->charge01Expr, binaryElement->charge01());
+            compileExpr(binaryElement->charge10Expr, binaryElement->charge10());
+        }
+        foreach(Interaction *interaction, findChildren<Interaction*>(QString(), Qt::FindDirectChildrenOnly)) {
+            compileExpr(interaction->factor11Expr, interaction->factor11());
+            compileExpr(interaction->factorA1Expr, interaction->factorA1());
+            compileExpr(interaction->factor1BExpr, interaction->factor1B());
+        }
+        foreach(StateGroup *group, findChildren<StateGroup*>(QString(), Qt::FindDirectChildrenOnly))
+            compileExprMap(group->attributeExprs, group->attributeExprsStr, group->attributes());
+        // Variable values are stored in their symbol slots (also when no expression refers to them).
+        foreach(Variable *variable, variables) {
+            std::string name = variable->name().toStdString();
+            auto it = _compiledSymbols.find(name);
+            variable->symbolSlot = it != _compiledSymbols.end() ? it->second : int(_compiledSymbols.size());
+            if(it == _compiledSymbols.end())
+                _compiledSymbols[name] = variable->symbolSlot;
+        }
+        initTransitionRatesPattern(numBinaryElements ? int(pow(2, numBinaryElements)) : stateNames.size());
+    }
+    
+    void MarkovModel::initTransitionRatesPattern(int numStates)
+    {
+        QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
+        QList<Interaction*> interactions = findChildren<Interaction*>(QString(), Qt::FindDirectChildrenOnly);
+        QList<Transition*> transitions = findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly);
+        typedef std::pair<int, int> StateIndexPair;
+        std::vector<Eigen::Triplet<double> > triplets;
+        auto addPairs = [&triplets](const std::vector<StateIndexPair> &pairs) {
+            for(const StateIndexPair &fromTo : pairs)
+                triplets.push_back(Eigen::Triplet<double>(fromTo.first, fromTo.second, 0));
+        };
+        for(int i = 0; i < numStates; ++i)
+            triplets.push_back(Eigen::Triplet<double>(i, i, 0));
+        if(!binaryElements.isEmpty()) {
+            foreach(BinaryElement *binaryElement, binaryElements) {
+                addPairs(binaryElement->stateIndexPairs01);
+                addPairs(binaryElement->stateIndexPairs10);
+            }
+            foreach(Interaction *interaction, interactions) {
+                if(interaction->A() && interaction->B()) {
+                    addPairs(interaction->stateIndexPairs1101);
+                    addPairs(interaction->stateIndexPairs1110);
+                    addPairs(interaction->stateIndexPairs0111);
+                    addPairs(interaction->stateIndexPairs1011);
+                }
+            }
+        } else {
+            foreach(Transition *transition, transitions) {
+                if(transition->from() && transition->to())
+                    triplets.push_back(Eigen::Triplet<double>(transition->from()->index(), transition->to()->index(), 0));
+            }
+        }
+        _transitionRatesPattern.resize(numStates, numStates);
+        _transitionRatesPattern.setFromTriplets(triplets.begin(), triplets.end());
+        _transitionRatesPattern.makeCompressed();
+        // Value indexes.
+        auto getSlots = [this](const std::vector<StateIndexPair> &pairs, std::vector<int> &slots) {
+            slots.resize(pairs.size());
+            for(size_t i = 0; i < pairs.size(); ++i)
+                slots[i] = transitionRateSlot(pairs[i].first, pairs[i].second);
+        };
+        _diagonalRateSlots.resize(numStates);
+        for(int i = 0; i < numStates; ++i)
+            _diagonalRateSlots[i] = transitionRateSlot(i, i);
+        foreach(BinaryElement *binaryElement, binaryElements) {
+            getSlots(binaryElement->stateIndexPairs01, binaryElement->rateSlots01);
+            getSlots(binaryElement->stateIndexPairs10, binaryElement->rateSlots10);
+        }
+        foreach(Interaction *interaction, interactions) {
+            getSlots(interaction->stateIndexPairs1101, interaction->rateSlots1101);
+            getSlots(interaction->stateIndexPairs1110, interaction->rateSlots1110);
+            getSlots(interaction->stateIndexPairs0111, interaction->rateSlots0111);
+            getSlots(interaction->stateIndexPairs1011, interaction->rateSlots1011);
+        }
+        foreach(Transition *transition, transitions)
+            transition->rateSlot = (binaryElements.isEmpty() && transition->from() && transition->to()) ? transitionRateSlot(transition->from()->index(), transition->to()->index()) : -1;
+    }
+    
+    int MarkovModel::transitionRateSlot(int from, int to) const
+    {
+        if(from < 0 || to < 0 || to >= _transitionRatesPattern.outerSize())
+            return -1;
+        const int *rows = _transitionRatesPattern.innerIndexPtr();
+        const int *first = rows + _transitionRatesPattern.outerIndexPtr()[to];
+        const int *last = rows + _transitionRatesPattern.outerIndexPtr()[to + 1];
+        const int *it = std::lower_bound(first, last, from);
+        return (it != last && *it == from) ? int(it - rows) : -1;
     }
     
-    void MarkovModel::evalVariables(const ParameterMap &stimuli, size_t variableSetIndex)
+    void MarkovModel::compileExpr(ModelExpression &expr, const QString &str)
     {
-        parameters = stimuli;
+        expr.str = str;
+        expr.compiled.compile(str.toStdString(), _compiledSymbols);
+    }
+    
+    void MarkovModel::compileExprMap(ModelExpressionMap &exprs, QString &exprsStr, const QString &str)
+    {
+        exprs.clear();
+        exprsStr = str;
+        for(auto &kv : str2exprMap(str))
+            compileExpr(exprs[kv.first], kv.second);
+    }
+    
+    void MarkovModel::evalVariables(const ParameterMap &stimuli, size_t variableSetIndex, Evaluator *evaluator)
+    {
+        Evaluator &ev = evaluator ? *evaluator : _evaluator;
+        ev.parameters = stimuli;
+        ev.symbolValues.assign(_compiledSymbols.size(), 0);
+        ev.isSymbolDefined.assign(_compiledSymbols.size(), false);
 #ifdef USE_EXPR_TK
-        _symbols.clear();
-        //_symbols.add_constants();
+        ev.symbols.clear();
+        //ev.symbols.add_constants();
 #else
-        _parser.vars().clear();
+        ev.parser.vars().clear();
 #endif
         for(ParameterMap::const_iterator it = stimuli.begin(); it != stimuli.end(); ++it) {
             std::string stimulusName = it->first.trimmed().toStdString();
             double stimulusValue = it->second;
+            CompiledExpression::SymbolTable::const_iterator slot = _compiledSymbols.find(stimulusName);
+            if(slot != _compiledSymbols.end()) {
+                ev.symbolValues[slot->second] = stimulusValue;
+                ev.isSymbolDefined[slot->second] = true;
+            }
 #ifdef USE_EXPR_TK
-            _symbols.add_variable(stimulusName, stimulusValue);
+            ev.symbols.add_variable(stimulusName, stimulusValue);
 #else
-            _parser.var(stimulusName) = stimulusValue;
+            ev.parser.var(stimulusName) = stimulusValue;
 #endif
         }
 #ifdef USE_EXPR_TK
-        _expr.register_symbol_table(_symbols);
+        ev.expr.register_symbol_table(ev.symbols);
 #endif
         foreach(Variable *variable, findChildren<Variable*>(QString(), Qt::FindDirectChildrenOnly)) {
             if((variable->index() == variableSetIndex) || (variable->index() < variableSetIndex && variable->numIndexes() <= variableSetIndex)) {
-                double value = evalExpr(variable->value());
-                parameters[variable->name()] = value;
+                double value = evalExpr(variable->valueExpr, variable->value(), &ev);
+                ev.parameters[variable->name()] = value;
+                if(variable->symbolSlot >= 0 && variable->symbolSlot < int(ev.symbolValues.size())) {
+                    ev.symbolValues[variable->symbolSlot] = value;
+                    ev.isSymbolDefined[variable->symbolSlot] = true;
+                }
 #ifdef USE_EXPR_TK
-                _symbols.add_variable(variable->name().toStdString(), value);
-                _expr.register_symbol_table(_symbols);
+                ev.symbols.add_variable(variable->name().toStdString(), value);
+                ev.expr.register_symbol_table(ev.symbols);
 #else
-                _parser.var(variable->name().toStdString()) = value;
+                ev.parser.var(variable->name().toStdString()) = value;
 #endif
             }
         }
+        if(!evaluator)
+            parameters = ev.parameters;
     }
     
     size_t MarkovModel::numVariableSets()
@@ -359,7 +515,7 @@ namespace MarkovModel
         return numSets;
     }
     
-    void MarkovModel::getStateProbabilities(Eigen::RowVectorXd &stateProbabilities)
+    void MarkovModel::getStateProbabilities(Eigen::RowVectorXd &stateProbabilities, Evaluator *evaluator)
     {
         QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
         int numBinaryElements = binaryElements.size();
@@ -368,7 +524,7 @@ namespace MarkovModel
             stateProbabilities = Eigen::RowVectorXd::Ones(numStates);
             Eigen::VectorXd binaryElementProbabilities0 = Eigen::VectorXd::Ones(numBinaryElements);
             for(int j = 0; j < numBinaryElements; ++j) {
-                double probability0 = evalExpr(binaryElements[j]->probability0());
+                double probability0 = evalExpr(binaryElements[j]->probability0Expr, binaryElements[j]->probability0(), evaluator);
                 if(probability0 != 1)
                     binaryElementProbabilities0[j] = probability0 < 0 ? 0 : (probability0 > 1 ? 1 : probability0);
             }
@@ -385,7 +541,7 @@ namespace MarkovModel
             stateProbabilities = Eigen::RowVectorXd::Zero(states.size());
             int i = 0;
             foreach(State *state, states) {
-                double probability = evalExpr(state->probability());
+                double probability = evalExpr(state->probabilityExpr, state->probability(), evaluator);
                 if(probability)
                     stateProbabilities[i] = probability < 0 ? 0 : (probability > 1 ? 1 : probability);
                 ++i;
@@ -398,7 +554,18 @@ namespace MarkovModel
         }
     }
     
-    void MarkovModel::getStateAttributes(std::map<QString, Eigen::RowVectorXd> &stateAttributes)
+    // Compiled named expressions if they are up to date with str, otherwise uncompiled expressions parsed from str.
+    static const ModelExpressionMap &exprMap(const ModelExpressionMap &compiledExprs, const QString &compiledStr, const QString &str, ModelExpressionMap &uncompiledExprs)
+    {
+        if(str == compiledStr)
+            return compiledExprs;
+        uncompiledExprs.clear();
+        for(auto &kv : str2exprMap(str))
+            uncompiledExprs[kv.first].str = kv.second;
+        return uncompiledExprs;
+    }
+    
+    void MarkovModel::getStateAttributes(std::map<QString, Eigen::RowVectorXd> &stateAttributes, Evaluator *evaluator)
     {
         QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
         QList<State*> states;
@@ -412,10 +579,11 @@ namespace MarkovModel
         }
         foreach(StateGroup *stateGroup, findChildren<StateGroup*>(QString(), Qt::FindDirectChildrenOnly)) {
             if(stateGroup->isActive()) {
-                std::map<QString, QString> attrExprs = str2exprMap(stateGroup->attributes());
-                for(std::map<QString, QString>::iterator it = attrExprs.begin(); it != attrExprs.end(); ++it) {
+                ModelExpressionMap uncompiledExprs;
+                const ModelExpressionMap &attrExprs = exprMap(stateGroup->attributeExprs, stateGroup->attributeExprsStr, stateGroup->attributes(), uncompiledExprs);
+                for(ModelExpressionMap::const_iterator it = attrExprs.begin(); it != attrExprs.end(); ++it) {
                     QString attrName = it->first;
-                    double attrValue = evalExpr(it->second);
+                    double attrValue = evalExpr(it->second, it->second.str, evaluator);
                     if(stateAttributes.find(attrName) == stateAttributes.end())
                         stateAttributes[attrName] = Eigen::RowVectorXd::Zero(numStates);
                     if(attrValue) {
@@ -430,10 +598,11 @@ namespace MarkovModel
             // state attribute overrides group attribute
             int stateIndex = 0;
             foreach(State *state, states) {
-                std::map<QString, QString> attrExprs = str2exprMap(state->attributes());
-                for(std::map<QString, QString>::iterator it = attrExprs.begin(); it != attrExprs.end(); ++it) {
+                ModelExpressionMap uncompiledExprs;
+                const ModelExpressionMap &attrExprs = exprMap(state->attributeExprs, state->attributeExprsStr, state->attributes(), uncompiledExprs);
+                for(ModelExpressionMap::const_iterator it = attrExprs.begin(); it != attrExprs.end(); ++it) {
                     QString attrName = it->first;
-                    double attrValue = evalExpr(it->second);
+                    double attrValue = evalExpr(it->second, it->second.str, evaluator);
                     if(stateAttributes.find(attrName) == stateAttributes.end())
                         stateAttributes[attrName] = Eigen::RowVectorXd::Zero(numStates);
                     if(attrValue)
@@ -444,82 +613,88 @@ namespace MarkovModel
         }
     }
     
-    void MarkovModel::getTransitionRates(Eigen::SparseMatrix<double> &transitionRates)
+    void MarkovModel::getTransitionRates(Eigen::SparseMatrix<double> &transitionRates, Evaluator *evaluator)
     {
+        // Copy the sparsity pattern built by init() and write the rates directly into its values.
+        transitionRates = _transitionRatesPattern;
+        double *rates = transitionRates.valuePtr();
         QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
         int numBinaryElements = binaryElements.size();
         if(numBinaryElements) {
-            int numStates = pow(2, numBinaryElements);
-            transitionRates.setZero();
-            transitionRates.resize(numStates, numStates);
+            if(transitionRates.rows() != int(pow(2, numBinaryElements)))
+                throw std::runtime_error("MarkovModel::getTransitionRates: Model changed since init().");
             foreach(BinaryElement *binaryElement, binaryElements) {
-                double rate01 = evalExpr(binaryElement->rate01());
-                double rate10 = evalExpr(binaryElement->rate10());
+                double rate01 = evalExpr(binaryElement->rate01Expr, binaryElement->rate01(), evaluator);
+                double rate10 = evalExpr(binaryElement->rate10Expr, binaryElement->rate10(), evaluator);
                 if(rate01 < 0)
                     throw std::runtime_error("Negative transition rate: '" + binaryElement->rate01().toStdString() + "'");
                 if(rate10 < 0)
                     throw std::runtime_error("Negative transition rate: '" + binaryElement->rate10().toStdString() + "'");
-                if(rate01 > 0) {
-                    for(const BinaryElement::StateIndexPair &fromTo : binaryElement->stateIndexPairs01)
-                        transitionRates.insert(fromTo.first, fromTo.second) = rate01;
-                }
-                if(rate10 > 0) {
-                    for(const BinaryElement::StateIndexPair &fromTo : binaryElement->stateIndexPairs10)
-                        transitionRates.insert(fromTo.first, fromTo.second) = rate10;
-                }
+                for(int slot : binaryElement->rateSlots01)
+                    rates[slot] = rate01;
+                for(int slot : binaryElement->rateSlots10)
+                    rates[slot] = rate10;
             }
             // Apply interaction multiplicative factors to all transitions where an element
             // involved in an interaction changed configuration.
             foreach(Interaction *interaction, findChildren<Interaction*>(QString(), Qt::FindDirectChildrenOnly)) {
                 if(interaction->A() && interaction->B()) {
-                    double factor11 = evalExpr(interaction->factor11());
-                    double factorA1 = evalExpr(interaction->factorA1());
-                    double factor1B = evalExpr(interaction->factor1B());
+                    double factor11 = evalExpr(interaction->factor11Expr, interaction->factor11(), evaluator);
+                    double factorA1 = evalExpr(interaction->factorA1Expr, interaction->factorA1(), evaluator);
+                    double factor1B = evalExpr(interaction->factor1BExpr, interaction->factor1B(), evaluator);
                     if(factor11 <= 0)
                         throw std::runtime_error("Negative or zero interaction factor: '" + interaction->factor11().toStdString() + "'");
                     if(factorA1 < 0)
                         throw std::runtime_error("Negative interaction factor: '" + interaction->factorA1().toStdString() + "'");
                     if(factor1B < 0)
                         throw std::runtime_error("Negative interaction factor: '" + interaction->factor1B().toStdString() + "'");
+                    if(interaction->rateSlots0111.size() != interaction->stateIndexPairs0111.size())
+                        throw std::runtime_error("MarkovModel::getTransitionRates: Model changed since init().");
                     if(factorA1 != 1) {
-                        for(const Interaction::StateIndexPair &fromTo : interaction->stateIndexPairs0111)
-                            transitionRates.coeffRef(fromTo.first, fromTo.second) *= factorA1;
+                        for(int slot : interaction->rateSlots0111)
+                            rates[slot] *= factorA1;
                     }
                     if(factor1B != 1) {
-                        for(const Interaction::StateIndexPair &fromTo : interaction->stateIndexPairs1011)
-                            transitionRates.coeffRef(fromTo.first, fromTo.second) *= factor1B;
+                        for(int slot : interaction->rateSlots1011)
+                            rates[slot] *= factor1B;
                     }
                     if(factorA1 / factor11 != 1) {
-                        for(const Interaction::StateIndexPair &fromTo : interaction->stateIndexPairs1101)
-                            transitionRates.coeffRef(fromTo.first, fromTo.second) *= (factorA1 / factor11);
+                        for(int slot : interaction->rateSlots1101)
+                            rates[slot] *= (factorA1 / factor11);
                     }
                     if(factor1B / factor11 != 1) {
-                        for(const Interaction::StateIndexPair &fromTo : interaction->stateIndexPairs1110)
-                            transitionRates.coeffRef(fromTo.first, fromTo.second) *= (factor1B / factor11);
+                        for(int slot : interaction->rateSlots1110)
+                            rates[slot] *= (factor1B / factor11);
                     }
                 }
             }
         } else {
-            QList<State*> states = findChildren<State*>(QString(), Qt::FindDirectChildrenOnly);
-            int numStates = states.size();
-            transitionRates.setZero();
-            transitionRates.resize(numStates, numStates);
+            if(transitionRates.rows() != findChildren<State*>(QString(), Qt::FindDirectChildrenOnly).size())
+                throw std::runtime_error("MarkovModel::getTransitionRates: Model changed since init().");
             foreach(Transition *transition, findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly)) {
                 if(transition->from() && transition->to()) {
-                    double rate = evalExpr(transition->rate());
+                    if(transition->rateSlot < 0)
+                        throw std::runtime_error("MarkovModel::getTransitionRates: Model changed since init().");
+                    double rate = evalExpr(transition->rateExpr, transition->rate(), evaluator);
                     if(rate < 0)
                         throw std::runtime_error("Negative transition rate: '" + transition->rate().toStdString() + "'");
-                    if(rate > 0)
-                        transitionRates.insert(transition->from()->index(), transition->to()->index()) = rate;
+                    rates[transition->rateSlot] += rate;
                 }
             }
         }
         // Set the diagonal elements so transition rates matrix is unitary (probability conservation).
-        for(int i = 0; i < transitionRates.rows(); i++)
-            transitionRates.coeffRef(i, i) = -transitionRates.row(i).sum();
+        // !!! Row sums in a single pass over the values, as the diagonal values are still zero.
+        int numStates = transitionRates.rows();
+        int numRates = transitionRates.nonZeros();
+        const int *rows = transitionRates.innerIndexPtr();
+        Eigen::VectorXd rowSums = Eigen::VectorXd::Zero(numStates);
+        for(int k = 0; k < numRates; ++k)
+            rowSums[rows[k]] += rates[k];
+        for(int i = 0; i < numStates; ++i)
+            rates[_diagonalRateSlots[i]] = -rowSums[i];
     }
     
-    void MarkovModel::getTransitionCharges(Eigen::SparseMatrix<double> &transitionCharges)
+    void MarkovModel::getTransitionCharges(Eigen::SparseMatrix<double> &transitionCharges, Evaluator *evaluator)
     {
         QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
         int numBinaryElements = binaryElements.size();
@@ -528,8 +703,8 @@ namespace MarkovModel
             transitionCharges.setZero();
             transitionCharges.resize(numStates, numStates);
             foreach(BinaryElement *binaryElement, binaryElements) {
-                double charge01 = evalExpr(binaryElement->charge01());
-                double charge10 = evalExpr(binaryElement->charge10());
+                double charge01 = evalExpr(binaryElement->charge01Expr, binaryElement->charge01(), evaluator);
+                double charge10 = evalExpr(binaryElement->charge10Expr, binaryElement->charge10(), evaluator);
                 if(charge01) {
                     for(const BinaryElement::StateIndexPair &fromTo : binaryElement->stateIndexPairs01)
                         transitionCharges.insert(fromTo.first, fromTo.second) = charge01;
@@ -546,7 +721,7 @@ namespace MarkovModel
             transitionCharges.resize(numStates, numStates);
             foreach(Transition *transition, findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly)) {
                 if(transition->from() && transition->to()) {
-                    double charge = evalExpr(transition->charge());
+                    double charge = evalExpr(transition->chargeExpr, transition->charge(), evaluator);
                     if(charge)
                         transitionCharges.insert(transition->from()->index(), transition->to()->index()) = charge;
                 }
@@ -554,22 +729,183 @@ namespace MarkovModel
         }
     }
     
-    double MarkovModel::evalExpr(const QString &expr)
+    void MarkovModel::getExprSymbols(std::set<QString> &symbols)
+    {
+        symbols.clear();
+        foreach(State *state, findChildren<State*>(QString(), Qt::FindDirectChildrenOnly)) {
+            addExprSymbols(state->probability(), symbols);
+            for(auto &kv : str2exprMap(state->attributes()))
+                addExprSymbols(kv.second, symbols);
+        }
+        foreach(Transition *transition, findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly)) {
+            addExprSymbols(transition->rate(), symbols);
+            addExprSymbols(transition->charge(), symbols);
+        }
+        foreach(BinaryElement *binaryElement, findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly)) {
+            addExprSymbols(binaryElement->probability0(), symbols);
+            addExprSymbols(binaryElement->rate01(), symbols);
+            addExprSymbols(binaryElement->rate10(), symbols);
+            addExprSymbols(binaryElement->charge01(), symbols);
+            addExprSymbols(binaryElement->charge10(), symbols);
+        }
+        foreach(Interaction *interaction, findChildren<Interaction*>(QString(), Qt::FindDirectChildrenOnly)) {
+            addExprSymbols(interaction->factor11(), symbols);
+            addExprSymbols(interaction->factorA1(), symbols);
+            addExprSymbols(interaction->factor1B(), symbols);
+        }
+        foreach(StateGroup *stateGroup, findChildren<StateGroup*>(QString(), Qt::FindDirectChildrenOnly)) {
+            if(stateGroup->isActive()) {
+                for(auto &kv : str2exprMap(stateGroup->attributes()))
+                    addExprSymbols(kv.second, symbols);
+            }
+        }
+    }
+    
+    // Coarsest refinement of the initial lumping (stateLabels) such that for any two lumped states I and J, each member of I
+    // has the same multiset of rate labels to members of J, and each member of J has the same multiset of rate labels from
+    // members of I. Rates are (from, to, label) with from != to.
+    static void refineStateLumping(const std::vector<int> &stateLabels, const std::vector<std::array<int, 3> > &rates, std::vector<int> &lumpedStateIndexes)
+    {
+        int numStates = stateLabels.size();
+        lumpedStateIndexes = stateLabels;
+        int numLumpedStates = std::set<int>(stateLabels.begin(), stateLabels.end()).size();
+        typedef std::vector<std::pair<int, int> > LabeledLinks; // (lumped state, rate label)
+        while(true) {
+            std::vector<LabeledLinks> links(2 * numStates); // [2 * i] = out of i, [2 * i + 1] = into i
+            for(const std::array<int, 3> &rate : rates) {
+                links[2 * rate[0]].push_back(std::make_pair(lumpedStateIndexes[rate[1]], rate[2]));
+                links[2 * rate[1] + 1].push_back(std::make_pair(lumpedStateIndexes[rate[0]], rate[2]));
+            }
+            std::map<std::pair<int, std::pair<LabeledLinks, LabeledLinks> >, int> signatures;
+            std::vector<int> refined(numStates);
+            for(int i = 0; i < numStates; ++i) {
+                std::sort(links[2 * i].begin(), links[2 * i].end());
+                std::sort(links[2 * i + 1].begin(), links[2 * i + 1].end());
+                auto signature = std::make_pair(lumpedStateIndexes[i], std::make_pair(links[2 * i], links[2 * i + 1]));
+                refined[i] = signatures.insert(std::make_pair(signature, int(signatures.size()))).first->second;
+            }
+            lumpedStateIndexes.swap(refined);
+            if(int(signatures.size()) == numLumpedStates)
+                break;
+            numLumpedStates = signatures.size();
+        }
+    }
+    
+    void MarkovModel::getStateLumping(StateLumping &lumping)
+    {
+        // Label each starting probability and transition rate by the sorted ids of the expressions whose values
+        // multiply (binary elements) or sum (states) to its value, so that equal labels imply equal values.
+        int numStates = _transitionRatesPattern.rows();
+        std::map<QString, int> exprIds;
+        auto exprId = [&exprIds](const QString &expr) { return exprIds.insert(std::make_pair(expr.trimmed(), int(exprIds.size()))).first->second; };
+        std::vector<std::vector<int> > stateTerms(numStates);
+        std::vector<std::vector<int> > rateTerms(_transitionRatesPattern.nonZeros());
+        auto addTerm = [&rateTerms](const std::vector<int> &slots, int id) {
+            for(int slot : slots) {
+                if(slot < 0 || slot >= int(rateTerms.size()))
+                    throw std::runtime_error("MarkovModel::getStateLumping: Model changed since init().");
+                rateTerms[slot].push_back(id);
+            }
+        };
+        QList<BinaryElement*> binaryElements = findChildren<BinaryElement*>(QString(), Qt::FindDirectChildrenOnly);
+        int numBinaryElements = binaryElements.size();
+        if(numBinaryElements) {
+            if(numStates != int(pow(2, numBinaryElements)))
+                throw std::runtime_error("MarkovModel::getStateLumping: Model changed since init().");
+            for(int j = 0; j < numBinaryElements; ++j) {
+                int probability0 = exprId(binaryElements[j]->probability0());
+                for(int i = 0; i < numStates; ++i)
+                    stateTerms[i].push_back(2 * probability0 + ((i & (1 << j)) ? 1 : 0));
+                addTerm(binaryElements[j]->rateSlots01, exprId(binaryElements[j]->rate01()));
+                addTerm(binaryElements[j]->rateSlots10, exprId(binaryElements[j]->rate10()));
+            }
+            foreach(Interaction *interaction, findChildren<Interaction*>(QString(), Qt::FindDirectChildrenOnly)) {
+                if(interaction->A() && interaction->B()) {
+                    QString factor11 = interaction->factor11().trimmed();
+                    QString factorA1 = interaction->factorA1().trimmed();
+                    QString factor1B = interaction->factor1B().trimmed();
+                    // Unit factors are skipped so that they do not distinguish otherwise equivalent states.
+                    if(factorA1 != "1")
+                        addTerm(interaction->rateSlots0111, exprId(factorA1));
+                    if(factor1B != "1")
+                        addTerm(interaction->rateSlots1011, exprId(factor1B));
+                    if(factorA1 != factor11)
+                        addTerm(interaction->rateSlots1101, exprId("(" + factorA1 + ")/(" + factor11 + ")"));
+                    if(factor1B != factor11)
+                        addTerm(interaction->rateSlots1110, exprId("(" + factor1B + ")/(" + factor11 + ")"));
+                }
+            }
+        } else {
+            QList<State*> states = findChildren<State*>(QString(), Qt::FindDirectChildrenOnly);
+            if(numStates != states.size())
+                throw std::runtime_error("MarkovModel::getStateLumping: Model changed since init().");
+            for(int i = 0; i < numStates; ++i)
+                stateTerms[i].push_back(exprId(states[i]->probability()));
+            foreach(Transition *transition, findChildren<Transition*>(QString(), Qt::FindDirectChildrenOnly)) {
+                if(transition->from() && transition->to())
+                    addTerm(std::vector<int>(1, transition->rateSlot), exprId(transition->rate()));
+            }
+        }
+        std::map<std::vector<int>, int> labels;
+        std::vector<int> stateLabels(numStates);
+        for(int i = 0; i < numStates; ++i) {
+            std::sort(stateTerms[i].begin(), stateTerms[i].end());
+            stateLabels[i] = labels.insert(std::make_pair(stateTerms[i], int(labels.size()))).first->second;
+        }
+        labels.clear();
+        std::vector<std::array<int, 3> > rates;
+        rates.reserve(rateTerms.size());
+        const int *outer = _transitionRatesPattern.outerIndexPtr();
+        const int *inner = _transitionRatesPattern.innerIndexPtr();
+        for(int to = 0; to < numStates; ++to) {
+            for(int k = outer[to]; k < outer[to + 1]; ++k) {
+                int from = inner[k];
+                if(from == to)
+                    continue; // Diagonal rates follow from the others.
+                std::sort(rateTerms[k].begin(), rateTerms[k].end());
+                int label = labels.insert(std::make_pair(rateTerms[k], int(labels.size()))).first->second;
+                rates.push_back(std::array<int, 3>{{from, to, label}});
+            }
+        }
+        std::vector<int> lumpedStateIndexes;
+        refineStateLumping(stateLabels, rates, lumpedStateIndexes);
+        lumping.init(lumpedStateIndexes);
+    }
+    
+    double MarkovModel::evalExpr(const QString &expr, Evaluator *evaluator)
     {
         if(expr.isEmpty())
             return 0;
+        Evaluator &ev = evaluator ? *evaluator : _evaluator;
 #ifdef USE_EXPR_TK
-        if(!_parser.compile(expr.toStdString(), _expr))
-            throw std::runtime_error("Failed to parse '" + expr.toStdString() + "': " + _parser.error());
-        return _expr.value();
+        if(!ev.parser.compile(expr.toStdString(), ev.expr))
+            throw std::runtime_error("Failed to parse '" + expr.toStdString() + "': " + ev.parser.error());
+        return ev.expr.value();
 #else
-        EigenLab::ValueXd result = _parser.eval(expr.toStdString());
+        EigenLab::ValueXd result = ev.parser.eval(expr.toStdString());
         if(result.matrix().size() != 1)
             throw std::runtime_error("Failed to reduce '" + expr.toStdString() + "' to a single number.");
         return result.matrix()(0, 0);
 #endif
     }
     
+    double MarkovModel::evalExpr(const ModelExpression &expr, const QString &str, Evaluator *evaluator)
+    {
+        Evaluator &ev = evaluator ? *evaluator : _evaluator;
+        if(expr.compiled.isCompiled() && expr.str == str) {
+            bool isDefined = true;
+            for(int slot : expr.compiled.slots()) {
+                if(slot >= int(ev.isSymbolDefined.size()) || !ev.isSymbolDefined[slot]) {
+                    isDefined = false;
+                    break;
+                }
+            }
+            if(isDefined)
+                return expr.compiled.eval(ev.symbolValues.data());
+        }
+        return evalExpr(str, &ev);
+    }
+    
     void MarkovModel::getFreeVariables(std::vector<double> &values, std::vector<double> &min, std::vector<double> &max)
     {
         values.clear();
@@ -595,6 +931,7 @@ namespace MarkovModel
                 if(it == values.end())
                     throw std::runtime_error("MarkovModel::setFreeVariables: Too few values supplied.");
                 variable->setValue(QString::number(*it));
+                compileExpr(variable->valueExpr, variable->value()); // Keep compiled value up to date (a number, so no new symbols).
                 ++it;
             }
         }
@@ -608,7 +945,7 @@ namespace MarkovModel
 #ifdef USE_EXPR_TK
 #else
         out << "Parameters:" << std::endl;
-        for(auto &kv : _parser.vars())
+        for(auto &kv : _evaluator.parser.vars())
             out << kv.first << " = " << kv.second.matrix() << std::endl;
 #endif
     }
@@ -624,7 +961,7 @@ namespace MarkovModel
     void MarkovModel::open(QString filePath)
     {
         if(filePath.isEmpty())
-            filePath = QFileDialog::getOpenFileName(0, "Open Markov Model...", _fileInfo.absoluteFilePath());
+            filePath = UserPrompts::getOpenFileName("Open Markov Model...", _fileInfo.absoluteFilePath());
         if(filePath.isEmpty())
             return;
         QFile file(filePath);
@@ -646,7 +983,7 @@ namespace MarkovModel
     void MarkovModel::saveAs(QString filePath)
     {
         if(filePath.isEmpty())
-            filePath = QFileDialog::getSaveFileName(0, "Save Markov Model...", _fileInfo.absoluteFilePath());
+            filePath = UserPrompts::getSaveFileName("Save Markov Model...", _fileInfo.absoluteFilePath());
         if(filePath.isEmpty())
             return;
         QFile file(filePath);
@@ -718,6 +1055,12 @@ namespace MarkovModel
             VERIFY(attrs["g"].isApprox(_g), "Invalid state g.");
             VERIFY(attrs["F"].isApprox(_F), "Invalid state F.");
             
+            VERIFY(x->valueExpr.compiled.isCompiled() && y->valueExpr.compiled.isCompiled() && AB->rateExpr.compiled.isCompiled() && B->attributeExprs.size() == 2, "Failed to compile expressions.");
+            
+            std::set<QString> symbols;
+            model.getExprSymbols(symbols);
+            VERIFY(symbols.count("x") && symbols.count("y") && symbols.count("sqrt") && !symbols.count("z"), "Invalid expression symbols.");
+            
             Eigen::SparseMatrix<double> Q;
             model.getTransitionRates(Q);
             Eigen::MatrixXd _Q(2, 2);
@@ -732,8 +1075,18 @@ namespace MarkovModel
             _Qc <<  0, 0,
                     0, 0;
             VERIFY(Qc.toDense().isApprox(_Qc), "Invalid transition charges.");
+
+            MarkovModel::Evaluator evaluator;
+            stimuli["z"] = 5;
+            model.evalVariables(stimuli, 0, &evaluator);
+            VERIFY(evaluator.parameters["x"] == 3.14*5, "Invalid evaluator parameter x.");
+            VERIFY(model.parameters["x"] == 3.14*3, "Separate evaluator altered model parameters.");
+            model.getTransitionRates(Q, &evaluator);
+            VERIFY(Q.coeff(0, 1) == 3.14*5, "Invalid evaluator transition rates.");
+            model.getTransitionRates(Q);
+            VERIFY(Q.toDense().isApprox(_Q), "Separate evaluator altered model transition rates.");
         }
-        
+
         BinaryElement *C = new BinaryElement(&model, "C");
         BinaryElement *D = new BinaryElement(&model, "D");
         Interaction *CD = new Interaction(&model, C, D);
@@ -807,6 +1160,43 @@ namespace MarkovModel
                      0,    0,     0,    9.42,
                      0,    0,    -9.42, 0;
             VERIFY(Qc.toDense().isApprox(_Qc), "Invalid transition charges.");
+            
+            StateLumping lumping;
+            model.getStateLumping(lumping);
+            VERIFY(!lumping.isReduced(), "Lumped states of nonidentical elements.");
+        }
+        
+        // Identical elements (charges do not matter).
+        D->setRate01("x");
+        D->setRate10("y/2");
+        CD->setFactor1B("10*y");
+        
+        {
+            std::cout << "Checking lumped binary elements model..." << std::endl;
+            
+            QStringList stateNames;
+            model.init(stateNames);
+            StateLumping lumping;
+            model.getStateLumping(lumping);
+            VERIFY(lumping.lumpedStateIndexes == std::vector<int>({0, 1, 1, 2}), "Invalid lumped states.");
+            
+            std::map<QString, double> stimuli;
+            stimuli["z"] = 3;
+            model.evalVariables(stimuli);
+            Eigen::SparseMatrix<double> Q;
+            model.getTransitionRates(Q);
+            Eigen::MatrixXd Ql = Eigen::MatrixXd(lumping.unlumpingMatrix * Q * lumping.lumpingMatrix);
+            Eigen::MatrixXd _Ql(3, 3);
+            double k01 = 3.14*3, k10 = 3.14, F11 = 2, FA1 = 10*6.28;
+            _Ql << -2*k01,            2*k01,                    0,
+                    k10,             -k10-k01*FA1,              k01*FA1,
+                    0,                2*k10*FA1/F11,           -2*k10*FA1/F11;
+            VERIFY(Ql.isApprox(_Ql), "Invalid lumped transition rates.");
+            
+            Eigen::RowVectorXd P, _P(4);
+            model.getStateProbabilities(P);
+            _P << 0, 0.25, 0.25, 0.5;
+            VERIFY((Eigen::RowVectorXd(P * lumping.lumpingMatrix) * lumping.unlumpingMatrix).isApprox(P) && (Eigen::RowVectorXd(_P * lumping.lumpingMatrix) * lumping.unlumpingMatrix).isApprox(_P), "Invalid lumped probabilities.");
         }
         
         model.dump(std::cout);
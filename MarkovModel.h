@@ -23,6 +23,7 @@
 #define __MarkovModel_H__
 
 #include <map>
+#include <set>
 #include <vector>
 #include <QDir>
 #include <QFileInfo>
@@ -36,6 +37,7 @@
 #else
 #include "EigenLab.h"
 #endif
+#include "CompiledExpression.h"
 #include "QObjectPropertyTreeSerializer.h"
 #ifdef DEBUG
 #include <iostream>
@@ -55,6 +57,49 @@ namespace MarkovModel
     // e.g. Used to parse State/StateGroup attributes.
     std::map<QString, QString> str2exprMap(const QString &str);
     
+    // Add the names referred to in a math expression (variables, stimuli or functions) to symbols.
+    void addExprSymbols(const QString &expr, std::set<QString> &symbols);
+    
+    /* --------------------------------------------------------------------------------
+     * Math expression compiled by MarkovModel::init() together with the string it was
+     * compiled from. The compiled form is only used while the string is unchanged.
+     * -------------------------------------------------------------------------------- */
+    struct ModelExpression
+    {
+        QString str;
+        CompiledExpression compiled;
+    };
+    typedef std::map<QString, ModelExpression> ModelExpressionMap; // Named expressions (e.g. attributes).
+    
+    /* --------------------------------------------------------------------------------
+     * Partition of a model's states into lumped states of kinetically equivalent states
+     * (e.g. binary element configurations that only differ by a permutation of identical
+     * elements, such as the subunits of a tetrameric channel).
+     * - For any two lumped states I and J, the rates from each member of I to all
+     *   members of J sum to the same value, as do the rates from all members of I to each
+     *   member of J. Thus the lumped model is exact, and probability that starts evenly
+     *   divided among the members of each lumped state stays evenly divided.
+     * - lumpingMatrix (numStates x numLumpedStates) sums the probability of member states,
+     *   e.g. lumpedProbability = probability * lumpingMatrix.
+     * - unlumpingMatrix (numLumpedStates x numStates) evenly divides probability among
+     *   member states, e.g. probability = lumpedProbability * unlumpingMatrix.
+     * - lumpedTransitionRates = unlumpingMatrix * transitionRates * lumpingMatrix.
+     * -------------------------------------------------------------------------------- */
+    struct StateLumping
+    {
+        std::vector<int> lumpedStateIndexes; // Lumped state index of each state.
+        Eigen::SparseMatrix<double> lumpingMatrix;
+        Eigen::SparseMatrix<double> unlumpingMatrix;
+        
+        // Lumped state indexes are renumbered in order of their first member state.
+        void init(const std::vector<int> &lumpedStateIndexes);
+        void clear() { init(std::vector<int>()); }
+        
+        int numStates() const { return lumpedStateIndexes.size(); }
+        int numLumpedStates() const { return lumpingMatrix.cols(); }
+        bool isReduced() const { return numLumpedStates() < numStates(); }
+    };
+    
     /* --------------------------------------------------------------------------------
      * Named value expression optionally allowed to vary within bounds.
      * - Value is a math expression that may refer to other variables by name.
@@ -84,7 +129,7 @@ namespace MarkovModel
     public:
         // Default constructor.
         Variable(QObject *parent = 0, const QString &name = "", const QString &value = "", const QString &description = "") :
-        QObject(parent), _isConst(true), _min(0), _max(0), _index(0), _numIndexes(1), _isNumber(false) { setName(name); setValue(value); setDescription(description); }
+        QObject(parent), symbolSlot(-1), _isConst(true), _min(0), _max(0), _index(0), _numIndexes(1), _isNumber(false) { setName(name); setValue(value); setDescription(description); }
         
         // Property getters.
         QString name() const { return objectName(); }
@@ -108,6 +153,10 @@ namespace MarkovModel
         void setIndex(size_t i) { _index = i; }
         void setNumIndexes(size_t i) { _numIndexes = i; }
         
+        // Compiled value expression and symbol slot (set by the parent model's init()).
+        ModelExpression valueExpr;
+        int symbolSlot;
+        
     protected:
         // Properties.
         QString _value;
@@ -167,6 +216,11 @@ namespace MarkovModel
         // Position (x, y, z).
         QVector3D position;
         
+        // Compiled expressions (set by the parent model's init()).
+        ModelExpression probabilityExpr;
+        ModelExpressionMap attributeExprs;
+        QString attributeExprsStr; // Attributes that attributeExprs were compiled from.
+        
     protected:
         // Properties.
         QString _probability;
@@ -190,7 +244,7 @@ namespace MarkovModel
     public:
         // Default constructor.
         Transition(QObject *parent = 0, State *from = 0, State *to = 0) :
-        QObject(parent), _from(from), _to(to), _rate("10"), _charge("0") { updateName(); }
+        QObject(parent), rateSlot(-1), _from(from), _to(to), _rate("10"), _charge("0") { updateName(); }
         
         // Property getters.
         State* from() const { return _from; }
@@ -211,6 +265,13 @@ namespace MarkovModel
         // Name reflects connected state names.
         void updateName() { setObjectName(fromName() + " -> " + toName()); }
         
+        // Compiled expressions (set by the parent model's init()).
+        ModelExpression rateExpr;
+        ModelExpression chargeExpr;
+        
+        // Index into the parent model's transition rates values (set by the parent model's init()).
+        int rateSlot;
+        
     protected:
         // Properties.
         State *_from;
@@ -281,6 +342,17 @@ namespace MarkovModel
         StateIndexPairs stateIndexPairs01; // 0 -> 1
         StateIndexPairs stateIndexPairs10; // 1 -> 0
         
+        // Compiled expressions (set by the parent model's init()).
+        ModelExpression probability0Expr;
+        ModelExpression rate01Expr;
+        ModelExpression rate10Expr;
+        ModelExpression charge01Expr;
+        ModelExpression charge10Expr;
+        
+        // Indexes into the parent model's transition rates values for each of the above state index pairs.
+        std::vector<int> rateSlots01;
+        std::vector<int> rateSlots10;
+        
         // Get lists of (from, to) state indexes for transitions where the specified element changes configuration.
         static void getStatePairs(int elementIndex, int numStates,
                                   StateIndexPairs &stateIndexPairs01, StateIndexPairs &stateIndexPairs10);
@@ -349,6 +421,17 @@ namespace MarkovModel
         StateIndexPairs stateIndexPairs0111; // AB: 01 -> 11 (*= factorA1)
         StateIndexPairs stateIndexPairs1011; // AB: 10 -> 11 (*= factor1B)
         
+        // Compiled expressions (set by the parent model's init()).
+        ModelExpression factor11Expr;
+        ModelExpression factorA1Expr;
+        ModelExpression factor1BExpr;
+        
+        // Indexes into the parent model's transition rates values for each of the above state index pairs.
+        std::vector<int> rateSlots1101;
+        std::vector<int> rateSlots1110;
+        std::vector<int> rateSlots0111;
+        std::vector<int> rateSlots1011;
+        
         // Get lists of (from, to) state indexes for transitions afected by an interaction between
         // specified binary elements.
         static void getStatePairs(int elementIndexA, int elementIndexB, int numStates,
@@ -401,6 +484,10 @@ namespace MarkovModel
         // List of state indexes belonging to this group.
         std::vector<int> stateIndexes;
         
+        // Compiled expressions (set by the parent model's init()).
+        ModelExpressionMap attributeExprs;
+        QString attributeExprsStr; // Attributes that attributeExprs were compiled from.
+        
         // Get the list of state indexes specified by a string of comma-separated state names.
         static void getStateIndexes(const QString &states, const QStringList &stateNames, std::vector<int> &stateIndexes);
         
@@ -432,6 +519,24 @@ namespace MarkovModel
         typedef std::map<QString, double> ParameterMap;
         ParameterMap parameters; // Only valid after evalVariables() is called.
         
+        // Expression evaluation context (evaluated parameters and math expression parser).
+        // Passing separate evaluators to evalVariables() and the parameter getters allows
+        // the model to be evaluated concurrently (e.g. for different variable sets).
+        // Otherwise, the model's own evaluator and parameters are used.
+        struct Evaluator
+        {
+            ParameterMap parameters;
+            std::vector<double> symbolValues; // Values of the model's compiled expression symbols.
+            std::vector<char> isSymbolDefined;
+#ifdef USE_EXPR_TK
+            exprtk::parser<double> parser;
+            exprtk::expression<double> expr;
+            exprtk::symbol_table<double> symbols;
+#else
+            EigenLab::ParserXd parser;
+#endif
+        };
+        
         // Default constructor.
         MarkovModel(QObject *parent = 0, const QString &name = "");
         
@@ -450,7 +555,7 @@ namespace MarkovModel
         Interaction* findInteraction(BinaryElement *A, BinaryElement *B);
         
         // This must be called after altering the model structure (nodes/connections) or state groups.
-        // Also supplies the names of the model's states.
+        // Also supplies the names of the model's states and compiles the model's expressions.
         void init(QStringList &stateNames);
         
         // Evaluate each variable's value expression. This must be done prior to querying model
@@ -459,17 +564,31 @@ namespace MarkovModel
         // Input setIndex refers to the set of variables to use, where multiple variables with the same name
         // are treated as belonging to separate variable sets. For variables with less repeats than
         // the maximum number of sets, the last repeat will be used for the remaining sets.
-        void evalVariables(const ParameterMap &stimuli = ParameterMap(), size_t variableSetIndex = 0);
+        void evalVariables(const ParameterMap &stimuli = ParameterMap(), size_t variableSetIndex = 0, Evaluator *evaluator = 0);
         size_t numVariableSets();
         
-        // Get model parameters. !!! Only valid after init() and evalVariables() have been called.
-        void getStateProbabilities(Eigen::RowVectorXd &stateProbabilities);
-        void getStateAttributes(std::map<QString, Eigen::RowVectorXd> &stateAttributes);
-        void getTransitionRates(Eigen::SparseMatrix<double> &transitionRates);
-        void getTransitionCharges(Eigen::SparseMatrix<double> &transitionCharges);
+        // Get model parameters. !!! Only valid after init() and evalVariables() have been called (with the same evaluator).
+        void getStateProbabilities(Eigen::RowVectorXd &stateProbabilities, Evaluator *evaluator = 0);
+        void getStateAttributes(std::map<QString, Eigen::RowVectorXd> &stateAttributes, Evaluator *evaluator = 0);
+        void getTransitionRates(Eigen::SparseMatrix<double> &transitionRates, Evaluator *evaluator = 0);
+        void getTransitionCharges(Eigen::SparseMatrix<double> &transitionCharges, Evaluator *evaluator = 0);
+        
+        // Names referred to by all state, transition, binary element, interaction and state group expressions.
+        // The model parameters above only depend on the evaluated values of these names.
+        void getExprSymbols(std::set<QString> &symbols);
+        
+        // Lump states that are equivalent given the model's structure and expressions (i.e. for any variable values).
+        // States are equivalent if their starting probabilities and transition rates are the same products (binary elements)
+        // or sums (states) of identical expressions. Charges and attributes do not affect the lumping.
+        // !!! Only valid after init().
+        void getStateLumping(StateLumping &lumping);
         
         // Evaluate a math expression resulting in a single value.
-        double evalExpr(const QString &expr);
+        double evalExpr(const QString &expr, Evaluator *evaluator = 0);
+        
+        // Evaluate a compiled expression without any parsing. Falls back to parsing str if the expression
+        // could not be compiled, was compiled from a different string, or refers to undefined names.
+        double evalExpr(const ModelExpression &expr, const QString &str, Evaluator *evaluator = 0);
         
         // Get/Set list of nonconstant variable values that do not depend on other parameters,
         // and also their min/max bounds. This is for parameter optimization.
@@ -491,14 +610,23 @@ namespace MarkovModel
         QString _notes;
         QFileInfo _fileInfo;
         
-        // Math expression parser.
-#ifdef USE_EXPR_TK
-        exprtk::parser<double> _parser;
-        exprtk::expression<double> _expr;
-        exprtk::symbol_table<double> _symbols;
-#else
-        EigenLab::ParserXd _parser;
-#endif
+        // Default math expression evaluator.
+        Evaluator _evaluator;
+        
+        // Symbol slots of compiled expressions.
+        CompiledExpression::SymbolTable _compiledSymbols;
+        
+        // Transition rates sparsity pattern (including the diagonal) built by init().
+        // getTransitionRates() copies the pattern and only writes its values.
+        Eigen::SparseMatrix<double> _transitionRatesPattern;
+        std::vector<int> _diagonalRateSlots;
+        
+        // Index of (from, to) into the transition rates pattern values (-1 if not in the pattern).
+        int transitionRateSlot(int from, int to) const;
+        void initTransitionRatesPattern(int numStates);
+        
+        void compileExpr(ModelExpression &expr, const QString &str);
+        void compileExprMap(ModelExpressionMap &exprs, QString &exprsStr, const QString &str);
     };
     
 #ifdef DEBUG
@@ -66,6 +66,8 @@ namespace MarkovModel
         simulationMenu->addSeparator();
         simulationMenu->addAction("Optimize", _project, SLOT(optimize()));
         simulationMenu->addSeparator();
+        simulationMenu->addAction("Save Simulation Profile", _project, SLOT(saveSimulationProfile()));
+        simulationMenu->addSeparator();
         simulationMenu->addAction("Simulation Options", _project, SLOT(editSimulationOptions()));
         menuBar()->addMenu(simulationMenu);
         
@@ -8,6 +8,7 @@
 #include "MarkovModelWindow.h"
 #include "QObjectPropertyEditor.h"
 #include "StimulusClampProtocol.h"
+#include "StimulusClampProtocolSimulatorDialog.h"
 #include "StimulusClampProtocolWindow.h"
 #include <QApplication>
 #include <QDesktopWidget>
@@ -354,7 +355,7 @@ namespace KineticModelBuilder
     void Project::editSimulationOptions()
     {
         QList<QByteArray> propertyNames;
-        propertyNames << "SimulationMethod" << "NumberOfMonteCarloRuns" << "AccumulateMonteCarloRuns" << "SampleMonteCarloProbability" << "NumberOfOptimizationIterations";
+        propertyNames << "SimulationMethod" << "NumberOfMonteCarloRuns" << "AccumulateMonteCarloRuns" << "SampleMonteCarloProbability" << "NumberOfMonteCarloEventChainsToKeep" << "NumberOfEnsembleChannels" << "RandomSeed" << "LumpEquivalentStates" << "NumberOfOptimizationIterations";
         editOptions("Simulation Options", propertyNames);
     }
     
@@ -384,28 +385,39 @@ namespace KineticModelBuilder
         }
         
         // StimulusClampProtocols.
-        StimulusClampProtocol::StimulusClampProtocolSimulator *stimulusClampProtocolSimulator = new StimulusClampProtocol::StimulusClampProtocolSimulator("Simulating " + model->name() + "...", _modelWindow);
+        StimulusClampProtocol::StimulusClampProtocolSimulatorDialog *stimulusClampProtocolSimulatorDialog = new StimulusClampProtocol::StimulusClampProtocolSimulatorDialog("Simulating " + model->name() + "...", _modelWindow);
+        StimulusClampProtocol::StimulusClampProtocolSimulator *stimulusClampProtocolSimulator = &stimulusClampProtocolSimulatorDialog->simulator;
         foreach(QWidget *widget, QApplication::topLevelWidgets()) {
             if(StimulusClampProtocol::StimulusClampProtocolWindow *window = qobject_cast<StimulusClampProtocol::StimulusClampProtocolWindow*>(widget)) {
                 stimulusClampProtocolSimulator->protocols.push_back(window->protocol());
-                connect(stimulusClampProtocolSimulator, SIGNAL(finished()), window, SLOT(replot()));
-                connect(stimulusClampProtocolSimulator, SIGNAL(finished()), window, SLOT(showMaxProbabilityError()));
+                connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), window, SLOT(replot()));
+                connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), window, SLOT(showMaxProbabilityError()));
             }
         }
         if(stimulusClampProtocolSimulator->protocols.size()) {
             stimulusClampProtocolSimulator->model = model;
             if(_simulationMethod == EigenSolver) {
                 stimulusClampProtocolSimulator->options["Method"] = "Eigen Solver";
+            } else if(_simulationMethod == MatrixExponential) {
+                stimulusClampProtocolSimulator->options["Method"] = "Matrix Exponential";
+            } else if(_simulationMethod == KrylovSubspace) {
+                stimulusClampProtocolSimulator->options["Method"] = "Krylov Subspace";
             } else if(_simulationMethod == MonteCarlo) {
                 stimulusClampProtocolSimulator->options["Method"] = "Monte Carlo";
                 stimulusClampProtocolSimulator->options["# Monte Carlo runs"] = _numMonteCarloRuns;
                 stimulusClampProtocolSimulator->options["Accumulate Monte Carlo runs"] = _accumulateMonteCarloRuns;
                 stimulusClampProtocolSimulator->options["Sample probability from Monte Carlo event chains"] = _sampleProbabilityFromMonteCarloEventChains;
+                stimulusClampProtocolSimulator->options["# Monte Carlo event chains to keep"] = _numMonteCarloEventChainsToKeep;
+            } else if(_simulationMethod == StochasticEnsemble) {
+                stimulusClampProtocolSimulator->options["Method"] = "Stochastic Ensemble";
+                stimulusClampProtocolSimulator->options["# Channels"] = _numEnsembleChannels;
             }
-            connect(stimulusClampProtocolSimulator, SIGNAL(finished()), this, SLOT(simulationFinished()));
-            stimulusClampProtocolSimulator->simulate();
+            stimulusClampProtocolSimulator->options["Random seed"] = _randomSeed;
+            stimulusClampProtocolSimulator->options["Lump equivalent states"] = _lumpEquivalentStates;
+            connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), this, SLOT(simulationFinished()));
+            stimulusClampProtocolSimulatorDialog->simulate();
         } else {
-            delete stimulusClampProtocolSimulator;
+            delete stimulusClampProtocolSimulatorDialog;
             _isBusy = false;
         }
     }
@@ -429,40 +441,73 @@ namespace KineticModelBuilder
         }
         
         // StimulusClampProtocols.
-        StimulusClampProtocol::StimulusClampProtocolSimulator *stimulusClampProtocolSimulator = new StimulusClampProtocol::StimulusClampProtocolSimulator("Simulating " + model->name() + "...", _modelWindow);
+        StimulusClampProtocol::StimulusClampProtocolSimulatorDialog *stimulusClampProtocolSimulatorDialog = new StimulusClampProtocol::StimulusClampProtocolSimulatorDialog("Simulating " + model->name() + "...", _modelWindow);
+        StimulusClampProtocol::StimulusClampProtocolSimulator *stimulusClampProtocolSimulator = &stimulusClampProtocolSimulatorDialog->simulator;
         foreach(QWidget *widget, QApplication::topLevelWidgets()) {
             if(StimulusClampProtocol::StimulusClampProtocolWindow *window = qobject_cast<StimulusClampProtocol::StimulusClampProtocolWindow*>(widget)) {
                 stimulusClampProtocolSimulator->protocols.push_back(window->protocol());
-                connect(stimulusClampProtocolSimulator, SIGNAL(finished()), window, SLOT(replot()));
-                connect(stimulusClampProtocolSimulator, SIGNAL(finished()), window, SLOT(showMaxProbabilityError()));
+                connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), window, SLOT(replot()));
+                connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), window, SLOT(showMaxProbabilityError()));
             }
         }
         if(stimulusClampProtocolSimulator->protocols.size()) {
             stimulusClampProtocolSimulator->model = model;
             if(_simulationMethod == EigenSolver) {
                 stimulusClampProtocolSimulator->options["Method"] = "Eigen Solver";
+            } else if(_simulationMethod == MatrixExponential) {
+                stimulusClampProtocolSimulator->options["Method"] = "Matrix Exponential";
+            } else if(_simulationMethod == KrylovSubspace) {
+                stimulusClampProtocolSimulator->options["Method"] = "Krylov Subspace";
             } else if(_simulationMethod == MonteCarlo) {
                 stimulusClampProtocolSimulator->options["Method"] = "Monte Carlo";
                 stimulusClampProtocolSimulator->options["# Monte Carlo runs"] = _numMonteCarloRuns;
                 stimulusClampProtocolSimulator->options["Accumulate Monte Carlo runs"] = _accumulateMonteCarloRuns;
                 stimulusClampProtocolSimulator->options["Sample probability from Monte Carlo event chains"] = _sampleProbabilityFromMonteCarloEventChains;
+                stimulusClampProtocolSimulator->options["# Monte Carlo event chains to keep"] = _numMonteCarloEventChainsToKeep;
+            } else if(_simulationMethod == StochasticEnsemble) {
+                stimulusClampProtocolSimulator->options["Method"] = "Stochastic Ensemble";
+                stimulusClampProtocolSimulator->options["# Channels"] = _numEnsembleChannels;
             }
-            connect(stimulusClampProtocolSimulator, SIGNAL(finished()), this, SLOT(simulationFinished()));
-            stimulusClampProtocolSimulator->optimize(_numOptimizationIterations); // Will delete itself when simulation is done.
+            stimulusClampProtocolSimulator->options["Random seed"] = _randomSeed;
+            stimulusClampProtocolSimulator->options["Lump equivalent states"] = _lumpEquivalentStates;
+            connect(stimulusClampProtocolSimulatorDialog, SIGNAL(finished()), this, SLOT(simulationFinished()));
+            stimulusClampProtocolSimulatorDialog->optimize(_numOptimizationIterations); // Will delete itself when simulation is done.
         } else {
-            delete stimulusClampProtocolSimulator;
+            delete stimulusClampProtocolSimulatorDialog;
             _isBusy = false;
         }
     }
     
     void Project::simulationFinished()
     {
+        // !!! The dialog deletes itself only after emitting finished().
+        QString profile;
+        if(StimulusClampProtocol::StimulusClampProtocolSimulatorDialog *dialog = qobject_cast<StimulusClampProtocol::StimulusClampProtocolSimulatorDialog*>(sender())) {
+            _simulationProfile = dialog->simulator.profile.toVariantMap();
+            profile = dialog->simulator.profile.toString();
+        }
         if(_modelWindow) {
             _modelWindow->repaint();
-            _modelWindow->statusBar()->showMessage("Elapsed time: " + QString::number(_timer.elapsed() / 1000.0) + " sec");
+            _modelWindow->statusBar()->showMessage("Elapsed time: " + QString::number(_timer.elapsed() / 1000.0) + " sec" + (profile.isEmpty() ? "" : " | " + profile));
         }
         _modelWindow = 0;
         _isBusy = false;
     }
+    
+    void Project::saveSimulationProfile(QString filePath)
+    {
+        if(_simulationProfile.isEmpty())
+            return;
+        if(filePath.isEmpty())
+            filePath = QFileDialog::getSaveFileName(0, "Save simulation profile...", _fileInfo.absolutePath());
+        if(filePath.isEmpty())
+            return;
+        QFile file(filePath);
+        if(!file.open(QIODevice::Text | QIODevice::WriteOnly))
+            return;
+        QTextStream out(&file);
+        out << QJsonDocument::fromVariant(_simulationProfile).toJson(QJsonDocument::Indented);
+        file.close();
+    }
 
 } // KineticModelBuilder
@@ -36,17 +36,21 @@ namespace KineticModelBuilder
         Q_PROPERTY(int NumberOfMonteCarloRuns READ numMonteCarloRuns WRITE setNumMonteCarloRuns)
         Q_PROPERTY(bool AccumulateMonteCarloRuns READ accumulateMonteCarloRuns WRITE setAccumulateMonteCarloRuns)
         Q_PROPERTY(bool SampleMonteCarloProbability READ sampleProbabilityFromMonteCarloEventChains WRITE setSampleProbabilityFromMonteCarloEventChains)
+        Q_PROPERTY(int NumberOfMonteCarloEventChainsToKeep READ numMonteCarloEventChainsToKeep WRITE setNumMonteCarloEventChainsToKeep)
+        Q_PROPERTY(int NumberOfEnsembleChannels READ numEnsembleChannels WRITE setNumEnsembleChannels)
+        Q_PROPERTY(qlonglong RandomSeed READ randomSeed WRITE setRandomSeed)
+        Q_PROPERTY(bool LumpEquivalentStates READ lumpEquivalentStates WRITE setLumpEquivalentStates)
         Q_PROPERTY(int NumberOfOptimizationIterations READ numOptimizationIterations WRITE setNumOptimizationIterations)
         Q_PROPERTY(bool AutoTileWindows READ autoTileWindows WRITE setAutoTileWindows)
         
     public:
-        enum  SimulationMethod { EigenSolver, MonteCarlo };
+        enum  SimulationMethod { EigenSolver, MonteCarlo, MatrixExponential, KrylovSubspace, StochasticEnsemble };
         Q_ENUMS(SimulationMethod)
         
         // For dynamic object creation.
         static QObjectPropertyTreeSerializer::ObjectFactory objectFactory;
         
-        Project() : _simulationMethod(MonteCarlo), _numMonteCarloRuns(1000), _accumulateMonteCarloRuns(false), _sampleProbabilityFromMonteCarloEventChains(true), _numOptimizationIterations(100), _autoTileWindows(true), _isBusy(false), _modelWindow(0) {}
+        Project() : _simulationMethod(MonteCarlo), _numMonteCarloRuns(1000), _accumulateMonteCarloRuns(false), _sampleProbabilityFromMonteCarloEventChains(true), _numMonteCarloEventChainsToKeep(-1), _numEnsembleChannels(1000), _randomSeed(-1), _lumpEquivalentStates(false), _numOptimizationIterations(100), _autoTileWindows(true), _isBusy(false), _modelWindow(0) {}
         
         // Property getters.
         static QString version() { return "4.2.0"; }
@@ -54,6 +58,10 @@ namespace KineticModelBuilder
         int numMonteCarloRuns() const { return _numMonteCarloRuns; }
         bool accumulateMonteCarloRuns() const { return _accumulateMonteCarloRuns; }
         bool sampleProbabilityFromMonteCarloEventChains() const { return _sampleProbabilityFromMonteCarloEventChains; }
+        int numMonteCarloEventChainsToKeep() const { return _numMonteCarloEventChainsToKeep; } // -1 => keep all
+        int numEnsembleChannels() const { return _numEnsembleChannels; }
+        qlonglong randomSeed() const { return _randomSeed; } // Negative for nondeterministic.
+        bool lumpEquivalentStates() const { return _lumpEquivalentStates; }
         int numOptimizationIterations() const { return _numOptimizationIterations; }
         bool autoTileWindows() const { return _autoTileWindows; }
         
@@ -62,6 +70,10 @@ namespace KineticModelBuilder
         void setNumMonteCarloRuns(int n) { _numMonteCarloRuns = n; }
         void setAccumulateMonteCarloRuns(bool b) { _accumulateMonteCarloRuns = b; }
         void setSampleProbabilityFromMonteCarloEventChains(bool b) { _sampleProbabilityFromMonteCarloEventChains = b; }
+        void setNumMonteCarloEventChainsToKeep(int n) { _numMonteCarloEventChainsToKeep = n; }
+        void setNumEnsembleChannels(int n) { _numEnsembleChannels = n; }
+        void setRandomSeed(qlonglong seed) { _randomSeed = seed; }
+        void setLumpEquivalentStates(bool b) { _lumpEquivalentStates = b; }
         void setNumOptimizationIterations(int n) { _numOptimizationIterations = n; }
         void setAutoTileWindows(bool b) { _autoTileWindows = b; }
         
@@ -85,6 +97,7 @@ namespace KineticModelBuilder
         void simulate(MarkovModel::MarkovModel *model = 0);
         void optimize(MarkovModel::MarkovModel *model = 0);
         void simulationFinished();
+        void saveSimulationProfile(QString filePath = "");
         
     protected:
         // Properties.
@@ -92,11 +105,16 @@ namespace KineticModelBuilder
         int _numMonteCarloRuns;
         bool _accumulateMonteCarloRuns;
         bool _sampleProbabilityFromMonteCarloEventChains;
+        int _numMonteCarloEventChainsToKeep;
+        int _numEnsembleChannels;
+        qlonglong _randomSeed;
+        bool _lumpEquivalentStates;
         int _numOptimizationIterations;
         bool _autoTileWindows;
         QFileInfo _fileInfo;
         bool _isBusy;
         QTime _timer;
+        QVariantMap _simulationProfile; // Per stage timing of the last simulation/optimization.
         MarkovModel::MarkovModelWindow *_modelWindow;
         
         // Creates a new Object and a UI for it.
@@ -5,40 +5,74 @@
 
 #include "StimulusClampProtocol.h"
 #include "EigenLab.h"
-#include "QObjectPropertyEditor.h"
+#include "TaskGraph.h"
+#include "UserPrompts.h"
 #include <algorithm>
 #include <climits>
 #include <cmath>
 #include <functional>
+#include <iostream>
+#include <numeric>
 #include <stdexcept>
-#include <QApplication>
-#include <QErrorMessage>
 #include <QFile>
-#include <QFileDialog>
-#include <QFuture>
 #include <QJsonDocument>
-#include <QMessageBox>
 #include <QTextStream>
-#include <QTimer>
 #include <QVariantMap>
-#include <QtConcurrentRun>
+#include <QtConcurrentMap>
+#include <Eigen/SparseLU>
+#include <Eigen/SparseQR>
+#include <unsupported/Eigen/MatrixFunctions>
 
 namespace StimulusClampProtocol
 {
-    Eigen::RowVectorXd equilibriumProbability(const Eigen::MatrixXd &Q)
+    Eigen::RowVectorXd equilibriumProbability(const Eigen::SparseMatrix<double> &Q)
     {
         int N = Q.cols(); // # of states.
-        // S is a copy of Q with one additional column of ones.
-        Eigen::MatrixXd S = Eigen::MatrixXd::Ones(N, N + 1);
-        S.block(0, 0, N, N) = Q;
-        // u is a row vector of ones.
-        Eigen::RowVectorXd u = Eigen::RowVectorXd::Ones(N);
-        // Return u * ( S * S^T )^-1
-        Eigen::MatrixXd St = S.transpose();
-        return u * ((S * St).inverse());
+        // Solve Q^T * p^T = 0 with sum(p) = 1. The balance equations are linearly dependent (rows of Q sum to zero),
+        // so the last one is replaced by the normalization constraint.
+        std::vector<Eigen::Triplet<double> > triplets;
+        triplets.reserve(Q.nonZeros() + N);
+        for(int k = 0; k < Q.outerSize(); ++k) {
+            for(Eigen::SparseMatrix<double>::InnerIterator it(Q, k); it; ++it) {
+                if(it.col() != N - 1 && it.value() != 0)
+                    triplets.push_back(Eigen::Triplet<double>(it.col(), it.row(), it.value()));
+            }
+        }
+        for(int i = 0; i < N; ++i)
+            triplets.push_back(Eigen::Triplet<double>(N - 1, i, 1));
+        Eigen::SparseMatrix<double> A(N, N);
+        A.setFromTriplets(triplets.begin(), triplets.end());
+        Eigen::VectorXd b = Eigen::VectorXd::Zero(N);
+        b[N - 1] = 1;
+        Eigen::SparseLU<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int> > lu(A);
+        if(lu.info() == Eigen::Success) {
+            Eigen::VectorXd p = lu.solve(b);
+            if(lu.info() == Eigen::Success && p.allFinite())
+                return p.transpose();
+        }
+        // Reducible chains do not have a unique equilibrium, so fall back to the least squares solution
+        // of [Q^T; 1 ... 1] * p^T = [0; 1].
+        triplets.clear();
+        for(int k = 0; k < Q.outerSize(); ++k) {
+            for(Eigen::SparseMatrix<double>::InnerIterator it(Q, k); it; ++it) {
+                if(it.value() != 0)
+                    triplets.push_back(Eigen::Triplet<double>(it.col(), it.row(), it.value()));
+            }
+        }
+        for(int i = 0; i < N; ++i)
+            triplets.push_back(Eigen::Triplet<double>(N, i, 1));
+        Eigen::SparseMatrix<double> S(N + 1, N);
+        S.setFromTriplets(triplets.begin(), triplets.end());
+        S.makeCompressed();
+        Eigen::VectorXd c = Eigen::VectorXd::Zero(N + 1);
+        c[N] = 1;
+        Eigen::SparseQR<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int> > qr(S);
+        if(qr.info() != Eigen::Success)
+            throw std::runtime_error("Failed to compute equilibrium state probabilities.");
+        return Eigen::VectorXd(qr.solve(c)).transpose();
     }
     
-    void spectralExpansion(const Eigen::SparseMatrix<double> &Q, Eigen::VectorXd &eigenValues, std::vector<Eigen::MatrixXd> &spectralMatrices, AbortFlag *abort)
+    void spectralExpansion(const Eigen::SparseMatrix<double> &Q, Eigen::VectorXd &eigenValues, Eigen::MatrixXd &eigenVectors, Eigen::MatrixXd &inverseEigenVectors, AbortFlag *abort)
     {
         int N = Q.cols(); // # of states.
         if(N < 2) throw std::runtime_error("Spectral expansion for less than two states does not make sense.");
@@ -51,15 +85,298 @@ namespace StimulusClampProtocol
         // Sort indexes based on comparing values in eigenvalues.
         std::sort(indexes.begin(), indexes.end(), [&eigVals](size_t i1, size_t i2) { return fabs(eigVals[i1]) < fabs(eigVals[i2]); });
         if(abort && *abort) return;
-        Eigen::MatrixXd invEigVecs = eigenSolver.pseudoEigenvectors().inverse();
-        eigenValues = Eigen::VectorXd::Zero(N);
-        spectralMatrices.assign(N, Eigen::MatrixXd::Zero(N, N));
+        const Eigen::MatrixXd &eigVecs = eigenSolver.pseudoEigenvectors();
+        Eigen::MatrixXd invEigVecs = eigVecs.inverse();
+        if(abort && *abort) return;
+        // The i-th spectral matrix is eigenVectors.col(i) * inverseEigenVectors.row(i).
+        eigenValues.resize(N);
+        eigenVectors.resize(N, N);
+        inverseEigenVectors.resize(N, N);
         for(int i = 0; i < N; ++i) {
-            if(abort && *abort) return;
             int j = indexes[i];
             eigenValues[i] = eigVals[j];
-            spectralMatrices[i] = eigenSolver.pseudoEigenvectors().col(j) * invEigVecs.row(j);
+            eigenVectors.col(i) = eigVecs.col(j);
+            inverseEigenVectors.row(i) = invEigVecs.row(j);
+        }
+    }
+    
+    void PropagatorCache::clear()
+    {
+        QMutexLocker locker(&_mutex);
+        _propagators.clear();
+    }
+    
+    std::map<double, Eigen::MatrixXd>::const_iterator PropagatorCache::find(double t) const
+    {
+        double tolerance = 1e-9 * fabs(t);
+        auto it = _propagators.lower_bound(t - tolerance);
+        if(it != _propagators.end() && it->first <= t + tolerance)
+            return it;
+        return _propagators.end();
+    }
+    
+    const Eigen::MatrixXd& PropagatorCache::propagator(const Eigen::SparseMatrix<double> &Q, double t)
+    {
+        {
+            QMutexLocker locker(&_mutex);
+            auto it = find(t);
+            if(it != _propagators.end())
+                return it->second;
         }
+        // Compute without holding the lock so that different intervals can be computed concurrently.
+        // !!! References to map elements stay valid when other elements are inserted.
+        Eigen::MatrixXd E = (Q.toDense() * t).exp();
+        QMutexLocker locker(&_mutex);
+        auto it = find(t);
+        if(it != _propagators.end())
+            return it->second;
+        return _propagators.emplace(t, std::move(E)).first->second;
+    }
+    
+    void MonteCarloJumpTable::clear()
+    {
+        _exitRates.clear();
+        _offsets.clear();
+        _entries.clear();
+    }
+    
+    void MonteCarloJumpTable::build(const Eigen::SparseMatrix<double> &Q)
+    {
+        int numStates = Q.rows();
+        // Rates leaving each state (Q is column major, so gather rows first).
+        std::vector<std::vector<std::pair<int, double> > > destinations(numStates);
+        for(int j = 0; j < Q.outerSize(); ++j) {
+            for(Eigen::SparseMatrix<double>::InnerIterator it(Q, j); it; ++it) {
+                if(it.row() != it.col() && it.value() > 0)
+                    destinations[it.row()].push_back(std::pair<int, double>(it.col(), it.value()));
+            }
+        }
+        _exitRates.assign(numStates, 0);
+        _offsets.assign(numStates + 1, 0);
+        _entries.clear();
+        std::vector<double> scaled;
+        std::vector<int> small, large;
+        for(int i = 0; i < numStates; ++i) {
+            _offsets[i] = _entries.size();
+            const std::vector<std::pair<int, double> > &dest = destinations[i];
+            int n = dest.size();
+            double kout = 0;
+            for(const std::pair<int, double> &d : dest)
+                kout += d.second;
+            _exitRates[i] = kout;
+            if(n == 0)
+                continue;
+            // Vose's alias method.
+            scaled.resize(n);
+            small.clear();
+            large.clear();
+            for(int k = 0; k < n; ++k) {
+                scaled[k] = dest[k].second * n / kout;
+                if(scaled[k] < 1)
+                    small.push_back(k);
+                else
+                    large.push_back(k);
+                AliasEntry entry;
+                entry.probability = 1;
+                entry.state = dest[k].first;
+                entry.alias = dest[k].first;
+                _entries.push_back(entry);
+            }
+            AliasEntry *entries = &_entries[_offsets[i]];
+            while(!small.empty() && !large.empty()) {
+                int s = small.back();
+                small.pop_back();
+                int l = large.back();
+                entries[s].probability = scaled[s];
+                entries[s].alias = dest[l].first;
+                scaled[l] -= 1 - scaled[s];
+                if(scaled[l] < 1) {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // Leftovers are 1 to within roundoff.
+        }
+        _offsets[numStates] = _entries.size();
+    }
+    
+    void MonteCarloEventChains::discardOpenChain()
+    {
+        if(isWide())
+            _wideStates.resize(_offsets.back());
+        else
+            _states.resize(_offsets.back());
+        _durations.resize(_offsets.back());
+    }
+    
+    void MonteCarloEventChains::clear()
+    {
+        _offsets.assign(1, 0);
+        _states.clear();
+        _wideStates.clear();
+        _durations.clear();
+    }
+    
+    void MonteCarloEventChains::truncate(size_t numChains)
+    {
+        if(numChains >= size())
+            return;
+        _offsets.resize(numChains + 1);
+        discardOpenChain();
+    }
+    
+    void MonteCarloEventChains::append(const MonteCarloEventChains &chains)
+    {
+        discardOpenChain();
+        size_t offset = _durations.size();
+        size_t numEvents = chains._offsets.back();
+        _offsets.reserve(_offsets.size() + chains.size());
+        for(size_t i = 1; i < chains._offsets.size(); ++i)
+            _offsets.push_back(offset + chains._offsets[i]);
+        if(isWide() == chains.isWide()) {
+            if(isWide())
+                _wideStates.insert(_wideStates.end(), chains._wideStates.begin(), chains._wideStates.begin() + numEvents);
+            else
+                _states.insert(_states.end(), chains._states.begin(), chains._states.begin() + numEvents);
+        } else {
+            for(size_t i = 0; i < chains.size(); ++i) {
+                Chain chain = chains.at(i);
+                for(size_t j = 0; j < chain.size(); ++j) {
+                    if(isWide())
+                        _wideStates.push_back(uint32_t(chain.state(j)));
+                    else
+                        _states.push_back(uint16_t(chain.state(j)));
+                }
+            }
+        }
+        _durations.insert(_durations.end(), chains._durations.begin(), chains._durations.begin() + numEvents);
+    }
+    
+    Eigen::VectorXd krylovExpv(double t, const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &v, int m, double tolerance)
+    {
+        KrylovWorkspace workspace;
+        return krylovExpv(t, A, v, workspace, m, tolerance);
+    }
+    
+    Eigen::VectorXd krylovExpv(double t, const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &v, KrylovWorkspace &workspace, int m, double tolerance)
+    {
+        // Based on Expokit's DGEXPV (Sidje, ACM Trans Math Softw 24:130-156, 1998).
+        int n = A.rows();
+        double normv = v.norm();
+        if(t == 0 || normv == 0)
+            return v;
+        if(workspace.anorm < 0) {
+            Eigen::VectorXd absRowSums = Eigen::VectorXd::Zero(n);
+            for(int k = 0; k < A.outerSize(); ++k) {
+                for(Eigen::SparseMatrix<double>::InnerIterator it(A, k); it; ++it)
+                    absRowSums[it.row()] += fabs(it.value());
+            }
+            workspace.anorm = absRowSums.maxCoeff();
+        }
+        double anorm = workspace.anorm;
+        if(anorm == 0)
+            return v;
+        if(m > n)
+            m = n;
+        const int maxRejections = 10;
+        const double breakdownTolerance = 1e-7;
+        const double gamma = 0.9;
+        const double delta = 1.2;
+        const double sign = t < 0 ? -1 : 1;
+        const double tout = fabs(t);
+        int mb = m;
+        int k1 = 2;
+        double xm = 1.0 / m;
+        double beta = normv;
+        double s;
+        double tnew = workspace.tnew;
+        if(tnew <= 0) {
+            double fact = pow((m + 1) / exp(1.0), m + 1) * sqrt(2 * M_PI * (m + 1));
+            tnew = (1 / anorm) * pow((fact * tolerance) / (4 * beta * anorm), xm);
+            s = pow(10, floor(log10(tnew)) - 1);
+            tnew = ceil(tnew / s) * s;
+        }
+        double tnow = 0;
+        Eigen::VectorXd w = v;
+        Eigen::MatrixXd &V = workspace.V;
+        Eigen::MatrixXd &H = workspace.H;
+        Eigen::MatrixXd &F = workspace.F;
+        Eigen::VectorXd &p = workspace.p;
+        V.resize(n, m + 1); // No-op if already allocated.
+        H.resize(m + 2, m + 2);
+        p.resize(n);
+        while(tnow < tout) {
+            double tstep = std::min(tout - tnow, tnew);
+            // Only the basis vectors that are filled in below are used, so V need not be cleared.
+            H.setZero();
+            V.col(0) = w / beta;
+            // Arnoldi process.
+            double avnorm = 0;
+            for(int j = 0; j < m; ++j) {
+                p.noalias() = A * V.col(j);
+                for(int i = 0; i <= j; ++i) {
+                    H(i, j) = V.col(i).dot(p);
+                    p -= H(i, j) * V.col(i);
+                }
+                s = p.norm();
+                if(s < breakdownTolerance) {
+                    // Happy breakdown: the Krylov subspace is invariant, so the step is exact.
+                    k1 = 0;
+                    mb = j + 1;
+                    tstep = tout - tnow;
+                    break;
+                }
+                H(j + 1, j) = s;
+                V.col(j + 1) = p / s;
+            }
+            if(k1 != 0) {
+                H(m + 1, m) = 1;
+                avnorm = (A * V.col(m)).norm();
+            }
+            // Small dense matrix exponential with local error estimate.
+            double errorEstimate = 0;
+            int numRejections = 0;
+            while(true) {
+                int mx = mb + k1;
+                F = (H.topLeftCorner(mx, mx) * (sign * tstep)).exp();
+                if(k1 == 0) {
+                    errorEstimate = breakdownTolerance;
+                    break;
+                }
+                double phi1 = fabs(beta * F(m, 0));
+                double phi2 = fabs(beta * F(m + 1, 0) * avnorm);
+                if(phi1 > 10 * phi2) {
+                    errorEstimate = phi2;
+                    xm = 1.0 / m;
+                } else if(phi1 > phi2) {
+                    errorEstimate = (phi1 * phi2) / (phi1 - phi2);
+                    xm = 1.0 / m;
+                } else {
+                    errorEstimate = phi1;
+                    xm = 1.0 / (m - 1);
+                }
+                if(errorEstimate <= delta * tstep * tolerance)
+                    break;
+                if(numRejections == maxRejections)
+                    throw std::runtime_error("Krylov subspace propagator failed to reach the requested tolerance.");
+                // Reject step and try a smaller one.
+                tstep = gamma * tstep * pow(tstep * tolerance / errorEstimate, xm);
+                s = pow(10, floor(log10(tstep)) - 1);
+                tstep = ceil(tstep / s) * s;
+                ++numRejections;
+            }
+            int mx = mb + std::max(0, k1 - 1);
+            w.noalias() = V.leftCols(mx) * (beta * F.col(0).head(mx));
+            beta = w.norm();
+            tnow += tstep;
+            if(k1 != 0) {
+                tnew = gamma * tstep * pow(tstep * tolerance / errorEstimate, xm);
+                s = pow(10, floor(log10(tnew)) - 1);
+                tnew = ceil(tnew / s) * s;
+                workspace.tnew = tnew;
+            }
+        }
+        return w;
     }
     
     void findIndexesInRange(const Eigen::VectorXd &time, double start, double stop, int *firstPt, int *numPts, double epsilon)
@@ -294,6 +611,69 @@ namespace StimulusClampProtocol
     }
     
     void Simulation::spectralSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated, size_t variableSetIndex, AbortFlag *abort, QString */* message */)
+    {
+        int numPts = time.size();
+        int numStates = startingProbability.size();
+        while(probability.size() <= variableSetIndex)
+            probability.push_back(Eigen::MatrixXd::Zero(numPts, numStates));
+        Eigen::MatrixXd &P = probability.at(variableSetIndex);
+        P.setZero(numPts, numStates);
+        Eigen::MatrixXd M; // Spectral expansion coefficients.
+        Eigen::MatrixXd E; // Exponent matrix.
+        Eigen::VectorXd epochTime; // Time relative to epoch start.
+        size_t epochCounter = 0;
+        for(const Epoch &epoch : epochs) {
+            if(abort && *abort) return;
+            const Eigen::VectorXd &lambda = epoch.uniqueEpochs[variableSetIndex]->spectralEigenValues;
+            const Eigen::MatrixXd &V = epoch.uniqueEpochs[variableSetIndex]->spectralEigenVectors;
+            const Eigen::MatrixXd &Vinv = epoch.uniqueEpochs[variableSetIndex]->spectralInverseEigenVectors;
+            if(epochCounter == 0 && startEquilibrated) {
+                // Set first epoch to equilibrium probabilities (projection onto the zero eigenvalue mode).
+                startingProbability = startingProbability.dot(V.col(0)) * Vinv.row(0);
+                if(epoch.numPts > 0)
+                    P.block(epoch.firstPt, 0, epoch.numPts, numStates).rowwise() = startingProbability;
+            } else {
+                // Coefficients of the spectral expansion: diag(p0 * V) * V^-1.
+                M.noalias() = (startingProbability * V).asDiagonal() * Vinv;
+                // Exponent matrix exp(lambda * t) for each sample point in the epoch with an additional last row for the epoch end,
+                // so that P(t) = exp(lambda * t) * M for the entire epoch and the next epoch's starting probability is one GEMM.
+                bool updateStartingProbability = (epochCounter + 1 < epochs.size());
+                int numRows = epoch.numPts + (updateStartingProbability ? 1 : 0);
+                if(numRows > 0) {
+                    epochTime.resize(numRows);
+                    if(epoch.numPts > 0)
+                        epochTime.head(epoch.numPts) = time.segment(epoch.firstPt, epoch.numPts).array() - epoch.start;
+                    if(updateStartingProbability)
+                        epochTime[epoch.numPts] = epoch.duration;
+                    if(epoch.numPts > 2 && sampleInterval > 0
+                       && fabs(epochTime[epoch.numPts - 1] - epochTime[0] - (epoch.numPts - 1) * sampleInterval) < 1e-6 * sampleInterval) {
+                        // Uniformly spaced sample points: exp(lambda * (t + dt)) = exp(lambda * t) * exp(lambda * dt).
+                        // Each eigenmode is re-anchored with an exact exponential every anchorInterval points to bound rounding error.
+                        const int anchorInterval = 64;
+                        E.resize(numRows, numStates);
+                        for(int j = 0; j < numStates; ++j) {
+                            double step = exp(lambda[j] * sampleInterval);
+                            double *e = E.col(j).data();
+                            for(int i = 0; i < epoch.numPts; ++i)
+                                e[i] = (i % anchorInterval == 0) ? exp(lambda[j] * epochTime[i]) : e[i - 1] * step;
+                            if(updateStartingProbability)
+                                e[epoch.numPts] = exp(lambda[j] * epoch.duration);
+                        }
+                    } else {
+                        E = (epochTime * lambda.transpose()).array().exp().matrix();
+                    }
+                    if(abort && *abort) return;
+                    if(epoch.numPts > 0)
+                        P.block(epoch.firstPt, 0, epoch.numPts, numStates).noalias() = E.topRows(epoch.numPts) * M;
+                    if(updateStartingProbability)
+                        startingProbability.noalias() = E.row(epoch.numPts) * M;
+                }
+            }
+            ++epochCounter;
+        }
+    }
+    
+    void Simulation::matrixExponentialSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated, size_t variableSetIndex, AbortFlag *abort, QString */* message */)
     {
         int numPts = time.size();
         int numStates = startingProbability.size();
@@ -306,29 +686,30 @@ namespace StimulusClampProtocol
             if(abort && *abort) return;
             if(epochCounter == 0 && startEquilibrated) {
                 // Set first epoch to equilibrium probabilities.
-                startingProbability = startingProbability * epoch.uniqueEpoch->spectralMatrices[0];
+                startingProbability = equilibriumProbability(epoch.uniqueEpochs[variableSetIndex]->transitionRates);
                 if(epoch.numPts > 0)
                     P.block(epoch.firstPt, 0, epoch.numPts, numStates).rowwise() = startingProbability;
             } else {
-                if(epoch.numPts > 0) {
-                    // Compute epoch probability using Q matrix spectral expansion.
-                    Eigen::VectorXd epochTime = time.segment(epoch.firstPt, epoch.numPts).array() - epoch.start;
-                    for(int i = 0; i < numStates; ++i) {
-                        if(abort && *abort) return;
-                        double lambda = epoch.uniqueEpoch->spectralEigenValues[i];
-                        Eigen::MatrixXd &A = epoch.uniqueEpoch->spectralMatrices[i];
-                        P.block(epoch.firstPt, 0, epoch.numPts, numStates) += (epochTime.array() * lambda).exp().matrix() * (startingProbability * A);
+                // Epochs start at a sample point and sample points within an epoch are evenly spaced,
+                // so each successive point is one step of the propagator expm(Q * dt) from the last.
+                const Eigen::SparseMatrix<double> &Q = epoch.uniqueEpochs[variableSetIndex]->transitionRates;
+                const Eigen::MatrixXd &E = epoch.uniqueEpochs[variableSetIndex]->propagators.propagator(Q, sampleInterval);
+                Eigen::RowVectorXd temp;
+                for(int i = 0; i < epoch.numPts; ++i) {
+                    if(abort && *abort) return;
+                    P.row(epoch.firstPt + i) = startingProbability;
+                    if(i + 1 < epoch.numPts) {
+                        temp.noalias() = startingProbability * E;
+                        startingProbability = temp;
                     }
                 }
                 if(epochCounter + 1 < epochs.size()) {
-                    // Update starting probability for next epoch.
-                    Eigen::RowVectorXd temp = Eigen::RowVectorXd::Zero(numStates);
-                    for(int i = 0; i < numStates; ++i) {
-                        if(abort && *abort) return;
-                        double lambda = epoch.uniqueEpoch->spectralEigenValues[i];
-                        Eigen::MatrixXd &A = epoch.uniqueEpoch->spectralMatrices[i];
-                        temp += ((startingProbability * A).array() * exp(lambda * epoch.duration)).matrix();
-                    }
+                    // Transfer to the start of the next epoch, which is usually one more sample step.
+                    double dt = epoch.numPts > 0 ? epoch.start + epoch.duration - time[epoch.firstPt + epoch.numPts - 1] : epoch.duration;
+                    if(fabs(dt - sampleInterval) <= 1e-9 * sampleInterval)
+                        temp.noalias() = startingProbability * E;
+                    else
+                        temp.noalias() = startingProbability * epoch.uniqueEpochs[variableSetIndex]->propagators.propagator(Q, dt);
                     startingProbability = temp;
                 }
             }
@@ -336,172 +717,443 @@ namespace StimulusClampProtocol
         }
     }
     
-    void Simulation::monteCarloSimulation(Eigen::RowVectorXd startingProbability, std::mt19937 &randomNumberGenerator, size_t numRuns, bool accumulateRuns, bool sampleRuns, bool startEquilibrated, size_t variableSetIndex, AbortFlag *abort, QString *message)
+    void Simulation::krylovSubspaceSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated, size_t variableSetIndex, AbortFlag *abort, QString */* message */)
     {
+        int numPts = time.size();
         int numStates = startingProbability.size();
+        while(probability.size() <= variableSetIndex)
+            probability.push_back(Eigen::MatrixXd::Zero(numPts, numStates));
+        Eigen::MatrixXd &P = probability.at(variableSetIndex);
+        P.setZero(numPts, numStates);
+        Eigen::VectorXd p = startingProbability.transpose();
+        Eigen::SparseMatrix<double> QT; // Transpose of Q matrix.
+        KrylovWorkspace workspace; // Shared by all steps within an epoch.
+        size_t epochCounter = 0;
+        for(const Epoch &epoch : epochs) {
+            if(abort && *abort) return;
+            if(epochCounter == 0 && startEquilibrated) {
+                // Set first epoch to equilibrium probabilities.
+                p = equilibriumProbability(epoch.uniqueEpochs[variableSetIndex]->transitionRates).transpose();
+                if(epoch.numPts > 0)
+                    P.block(epoch.firstPt, 0, epoch.numPts, numStates).rowwise() = p.transpose();
+            } else {
+                // Step from one sample point to the next (and then to the start of the next epoch).
+                // Each step continues with the adaptive step size of the previous one, so the epoch is
+                // integrated as a single adaptive Krylov integration that is sampled at each sample point.
+                QT = epoch.uniqueEpochs[variableSetIndex]->transitionRates.transpose();
+                workspace.reset();
+                for(int i = 0; i < epoch.numPts; ++i) {
+                    if(abort && *abort) return;
+                    P.row(epoch.firstPt + i) = p.transpose();
+                    if(i + 1 < epoch.numPts)
+                        p = krylovExpv(sampleInterval, QT, p, workspace);
+                }
+                if(epochCounter + 1 < epochs.size()) {
+                    // Transfer to the start of the next epoch, which need not be one sample step away.
+                    double dt = epoch.numPts > 0 ? epoch.start + epoch.duration - time[epoch.firstPt + epoch.numPts - 1] : epoch.duration;
+                    p = krylovExpv(dt, QT, p, workspace);
+                }
+            }
+            ++epochCounter;
+        }
+    }
+    
+    void Simulation::monteCarloSimulation(Eigen::RowVectorXd startingProbability, uint64_t &seed, size_t numRuns, bool accumulateRuns, bool sampleRuns, bool startEquilibrated, int numEventChainsToKeep, size_t variableSetIndex, AbortFlag *abort, QString *message)
+    {
+        int numStates = startingProbability.size();
+        size_t numPts = time.size();
         if(events.size() <= variableSetIndex)
             events.resize(1 + variableSetIndex);
-        std::vector<MonteCarloEventChain> &eventChains = events.at(variableSetIndex);
-        if(!accumulateRuns)
-            eventChains.clear();
-        size_t prevNumRuns = eventChains.size();
-        eventChains.resize(prevNumRuns + numRuns);
-        std::uniform_real_distribution<double> randomUniform(0, 1); // Uniform random numbers in [0, 1)
-        double epsilon = std::numeric_limits<double>::epsilon() * 5;
+        if(numMonteCarloRuns.size() <= variableSetIndex)
+            numMonteCarloRuns.resize(1 + variableSetIndex, 0);
+        while(probability.size() <= variableSetIndex)
+            probability.push_back(Eigen::MatrixXd());
+        MonteCarloEventChains &eventChains = events.at(variableSetIndex);
+        Eigen::MatrixXd &P = probability.at(variableSetIndex);
+        // The accumulated runs, their kept event chains and their probability are carried over (or cleared) together.
+        size_t prevNumRuns = numMonteCarloRuns.at(variableSetIndex);
+        bool accumulate = accumulateRuns && prevNumRuns && eventChains.numStates() == numStates;
+        if(accumulate && sampleRuns && (P.rows() != int(numPts) || P.cols() != numStates)) {
+            // Probability was not sampled for the accumulated runs (or for different sample points),
+            // so resample it from their event chains if all of them were kept.
+            if(eventChains.size() == prevNumRuns)
+                getProbabilityFromEventChains(P, numStates, eventChains, abort);
+            else
+                accumulate = false;
+        }
+        if(!accumulate) {
+            eventChains.clear(numStates);
+            P.resize(0, 0);
+            prevNumRuns = 0;
+        }
+        numMonteCarloRuns.at(variableSetIndex) = prevNumRuns;
+        // Only the first numEventChainsToKeep event chains are stored (all if negative).
+        // Probability is accumulated while the chains are generated, so memory use for the
+        // remaining runs is bounded by the sample grid rather than by the number of events.
+        size_t maxNumEventChains = numEventChainsToKeep < 0 ? prevNumRuns + numRuns : size_t(numEventChainsToKeep);
+        if(eventChains.size() > maxNumEventChains)
+            eventChains.truncate(maxNumEventChains);
+        size_t numNewEventChains = std::min(maxNumEventChains - eventChains.size(), numRuns);
         if(startEquilibrated)
-            startingProbability = equilibriumProbability(epochs.begin()->uniqueEpoch->transitionRates.toDense());
-        Eigen::SparseMatrix<double> QT; // Transpose of Q matrix. !!! Needs to be updated for each epoch.
-        for(size_t run = prevNumRuns; run < prevNumRuns + numRuns; ++run) {
-            if(abort && *abort) return;
-            MonteCarloEventChain &eventChain = eventChains.at(run);
-            eventChain.reserve(1000);
-            size_t eventCounter = 0;
-            MonteCarloEvent event;
-            // Set starting state.
-            event.state = -1;
-            double prnd = randomUniform(randomNumberGenerator); // [0, 1)
-            double ptot = 0;
-            for(int i = 0; i < numStates; ++i) {
-                ptot += startingProbability[i];
-                if(ptot > prnd) {
-                    event.state = i;
-                    break;
-                }
+            startingProbability = equilibriumProbability(epochs.begin()->uniqueEpochs[variableSetIndex]->transitionRates);
+        // Each run has its own random number stream keyed by (seed, run), so runs are distributed across threads
+        // without the results depending on the number of threads. The seed is advanced afterwards so that
+        // accumulated batches of runs differ.
+        // Runs are split into a fixed number of contiguous blocks (depending only on the number of runs), each with
+        // its own probability accumulator and kept event chains, and the blocks are merged in order.
+        uint64_t batchSeed = seed;
+        seed = deriveSeed(seed, 1);
+        const size_t minRunsPerBlock = 16;
+        const size_t maxNumBlocks = 32;
+        size_t numBlocks = std::min((numRuns + minRunsPerBlock - 1) / minRunsPerBlock, maxNumBlocks);
+        std::vector<size_t> blocks(numBlocks);
+        std::iota(blocks.begin(), blocks.end(), 0);
+        std::vector<Eigen::MatrixXd> blockProbabilities(numBlocks);
+        std::vector<MonteCarloEventChains> blockEventChains(numBlocks, MonteCarloEventChains(numStates));
+        QtConcurrent::blockingMap(blocks, [&](size_t &block) {
+            size_t firstRun = block * numRuns / numBlocks;
+            size_t lastRun = (block + 1) * numRuns / numBlocks;
+            Eigen::MatrixXd &blockP = blockProbabilities.at(block);
+            if(sampleRuns)
+                blockP.setZero(numPts, numStates);
+            MonteCarloEventChains &keptChains = blockEventChains.at(block);
+            MonteCarloEventChains scratchChain(numStates); // For runs whose chains are not kept.
+            for(size_t run = firstRun; run < lastRun; ++run) {
+                if(abort && *abort) return;
+                Philox4x32 rng(batchSeed, run);
+                MonteCarloEventChains &chains = run < numNewEventChains ? keptChains : scratchChain;
+                if(&chains == &scratchChain)
+                    scratchChain.clear();
+                simulateMonteCarloEventChain(chains, startingProbability, rng, variableSetIndex, abort);
+                if(sampleRuns && !chains.empty())
+                    accumulateEventChainOccupancy(blockP, chains.at(chains.size() - 1));
             }
-            if(event.state == -1) {
-                event.state = numStates - 1;
-//                if(message) *message = "Failed to set starting state.";
-//                if(abort) *abort = true;
-//                return;
+        });
+        if(abort && *abort) return;
+        for(const MonteCarloEventChains &chains : blockEventChains)
+            eventChains.append(chains);
+        numMonteCarloRuns.at(variableSetIndex) = prevNumRuns + numRuns;
+        if(sampleRuns) {
+            Eigen::MatrixXd occupancy = Eigen::MatrixXd::Zero(numPts, numStates);
+            for(const Eigen::MatrixXd &blockProbability : blockProbabilities)
+                occupancy += blockProbability;
+            if(prevNumRuns)
+                P = (P * double(prevNumRuns) + occupancy) / double(prevNumRuns + numRuns);
+            else
+                P = occupancy / double(numRuns);
+        } else {
+            // Probability is sampled from the kept event chains when needed (see evalSimulationWaveforms).
+            P.resize(0, 0);
+        }
+    }
+    
+    void Simulation::simulateMonteCarloEventChain(MonteCarloEventChains &eventChains, const Eigen::RowVectorXd &startingProbability, Philox4x32 &rng, size_t variableSetIndex, AbortFlag *abort)
+    {
+        int numStates = startingProbability.size();
+        double epsilon = std::numeric_limits<double>::epsilon() * 5;
+        MonteCarloEvent event;
+        // Set starting state.
+        event.state = -1;
+        double prnd = rng.uniform(); // [0, 1)
+        double ptot = 0;
+        for(int i = 0; i < numStates; ++i) {
+            ptot += startingProbability[i];
+            if(ptot > prnd) {
+                event.state = i;
+                break;
             }
-            double eventChainDuration = 0;
-            std::vector<Epoch>::iterator epochIter = epochs.begin();
-            QT = epochIter->uniqueEpoch->transitionRates.transpose();
-            while(eventChainDuration < endTime) {
-                if(abort && *abort) return;
-//                double lifetime = 0;
-                // Check if stuck in state.
-//                double kout = -epochIter->uniqueEpoch->transitionRates.coeff(event.state, event.state); // Net rate leaving state.
-//                while(kout < epsilon) {
-//                    lifetime = epochIter->start + epochIter->duration - eventChainDuration;
-//                    // Go to next epoch.
-//                    ++epochIter;
-//                    if(epochIter == epochs.end())
-//                        break;
-//                    eventChainDuration = epochIter->start;
-////                    event.duration = endTime - eventChainDuration; // Remaining time.
-////                    eventChain.push_back(event);
-////                    break;
-//                }
-                // Lifetime in state.
-                double kout = -epochIter->uniqueEpoch->transitionRates.coeff(event.state, event.state); // Net rate leaving state.
-                double lifetime = kout < epsilon ? endTime : epochIter->uniqueEpoch->randomStateLifetimes[event.state](randomNumberGenerator);
-                bool epochChanged = false;
-                while(eventChainDuration + lifetime > epochIter->start + epochIter->duration) { // Event takes us to the next epoch.
-                    // Truncate lifetime to end of epoch.
-                    lifetime = epochIter->start + epochIter->duration - eventChainDuration;
-                    // Go to next epoch.
-                    ++epochIter;
-                    if(epochIter == epochs.end())
-                        break;
-                    // Check if stuck in state.
-                    kout = -epochIter->uniqueEpoch->transitionRates.coeff(event.state, event.state); // Net rate leaving state.
-//                    if(kout < epsilon) {
-//                        epochIter = epochs.end();
-//                        break;
-//                    }
-                    // Lifetime extends into new epoch.
-                    lifetime += kout < epsilon ? endTime : epochIter->uniqueEpoch->randomStateLifetimes[event.state](randomNumberGenerator);
-                    epochChanged = true;
-                }
-                // Check if we reached the end of the chain's duration.
-                if(epochIter == epochs.end()) {
-                    event.duration = endTime - eventChainDuration; // Remaining time.
-                    eventChain.push_back(event);
+        }
+        if(event.state == -1)
+            event.state = numStates - 1;
+        double eventChainDuration = 0;
+        std::vector<Epoch>::iterator epochIter = epochs.begin();
+        const MonteCarloJumpTable *jumpTable = &epochIter->uniqueEpochs[variableSetIndex]->jumpTable;
+        while(eventChainDuration < endTime) {
+            if(abort && *abort) {
+                eventChains.discardOpenChain();
+                return;
+            }
+            // Lifetime in state (exponentially distributed).
+            double kout = jumpTable->exitRate(event.state);
+            double lifetime = kout < epsilon ? endTime : -std::log(1 - rng.uniform()) / kout;
+            while(eventChainDuration + lifetime > epochIter->start + epochIter->duration) { // Event takes us to the next epoch.
+                // Truncate lifetime to end of epoch.
+                lifetime = epochIter->start + epochIter->duration - eventChainDuration;
+                // Go to next epoch.
+                ++epochIter;
+                if(epochIter == epochs.end())
                     break;
-                }
-                if(epochChanged)
-                    QT = epochIter->uniqueEpoch->transitionRates.transpose();
-                // Add event to chain.
-                event.duration = lifetime;
-                eventChain.push_back(event);
-                eventChainDuration += lifetime;
-                ++eventCounter;
-                if(eventCounter == 1000) {
-                    eventChain.reserve(eventChain.size() + 1000);
-                    eventCounter = 0;
-                }
-                // Go to next state.
-                if(eventChainDuration < endTime) {
-                    // Select next state based on rates leaving current state.
-                    prnd = randomUniform(randomNumberGenerator); // [0, 1)
-                    ptot = 0;
-                    for(Eigen::SparseMatrix<double>::InnerIterator it(QT, event.state); it; ++it) {
-                        if(it.row() != event.state) {
-                            ptot += it.value() / kout;
-                            if(ptot >= prnd) {
-                                event.state = it.row();
-                                break;
-                            }
-                        }
+                // Check if stuck in state.
+                jumpTable = &epochIter->uniqueEpochs[variableSetIndex]->jumpTable;
+                kout = jumpTable->exitRate(event.state);
+                // Lifetime extends into new epoch.
+                lifetime += kout < epsilon ? endTime : -std::log(1 - rng.uniform()) / kout;
+            }
+            // Check if we reached the end of the chain's duration.
+            if(epochIter == epochs.end()) {
+                event.duration = endTime - eventChainDuration; // Remaining time.
+                eventChains.push_back(event);
+                break;
+            }
+            // Add event to chain.
+            event.duration = lifetime;
+            eventChains.push_back(event);
+            eventChainDuration += lifetime;
+            // Go to next state.
+            if(eventChainDuration < endTime)
+                event.state = jumpTable->nextState(event.state, rng.uniform());
+        }
+        eventChains.endChain();
+    }
+    
+    // Tail of Stirling's approximation, log(k!) - [(k + 1/2) log(k + 1) - (k + 1) + log(2 pi) / 2].
+    static double stirlingApproximationTail(double k)
+    {
+        static const double tails[] = {0.0810614667953272, 0.0413406959554092, 0.0276779256849983, 0.02079067210376509, 0.0166446911898211,
+                                       0.0138761288230707, 0.0118967099458917, 0.0104112652619720, 0.00925546218271273, 0.00833056343336287};
+        if(k <= 9)
+            return tails[int(k)];
+        double kp1sq = (k + 1) * (k + 1);
+        return (1.0 / 12 - (1.0 / 360 - 1.0 / 1260 / kp1sq) / kp1sq) / (k + 1);
+    }
+    
+    // Binomial random number (clamps p to [0, 1]) drawn from the Philox uniform stream, so that the draws do not depend
+    // on the standard library. Inversion for small n * p, otherwise BTRS transformed rejection with squeeze
+    // (Hormann, J Stat Comput Simul 46:101-110, 1993).
+    static long long randomBinomial(Philox4x32 &rng, long long n, double p)
+    {
+        if(n <= 0 || p <= 0)
+            return 0;
+        if(p >= 1)
+            return n;
+        if(p > 0.5)
+            return n - randomBinomial(rng, n, 1 - p);
+        if(n * p < 10) {
+            // Count the successes whose geometrically distributed waiting times fit within n trials.
+            double logq = log1p(-p);
+            double numTrials = 0;
+            long long k = 0;
+            while(true) {
+                numTrials += ceil(log(rng.uniform()) / logq);
+                if(numTrials > n)
+                    return k;
+                ++k;
+            }
+        }
+        double q = 1 - p;
+        double spq = sqrt(n * p * q);
+        double b = 1.15 + 2.53 * spq;
+        double a = -0.0873 + 0.0248 * b + 0.01 * p;
+        double c = n * p + 0.5;
+        double vr = 0.92 - 4.2 / b;
+        double r = p / q;
+        double alpha = (2.83 + 5.1 / b) * spq;
+        double m = floor((n + 1) * p);
+        while(true) {
+            double u = rng.uniform() - 0.5;
+            double v = rng.uniform();
+            double us = 0.5 - fabs(u);
+            double k = floor((2 * a / us + b) * u + c);
+            if(k < 0 || k > n)
+                continue;
+            if(us >= 0.07 && v <= vr)
+                return (long long)k;
+            v = log(v * alpha / (a / (us * us) + b));
+            double bound = (m + 0.5) * log((m + 1) / (r * (n - m + 1))) + (n + 1) * log((n - m + 1) / (n - k + 1))
+                         + (k + 0.5) * log(r * (n - k + 1) / (k + 1)) + stirlingApproximationTail(m) + stirlingApproximationTail(n - m)
+                         - stirlingApproximationTail(k) - stirlingApproximationTail(n - k);
+            if(v <= bound)
+                return (long long)k;
+        }
+    }
+    
+    void Simulation::stochasticEnsembleSimulation(Eigen::RowVectorXd startingProbability, uint64_t &seed, size_t numChannels, bool startEquilibrated, size_t variableSetIndex, AbortFlag *abort, QString */* message */)
+    {
+        int numPts = time.size();
+        int numStates = startingProbability.size();
+        while(probability.size() <= variableSetIndex)
+            probability.push_back(Eigen::MatrixXd::Zero(numPts, numStates));
+        Eigen::MatrixXd &P = probability.at(variableSetIndex);
+        P.setZero(numPts, numStates);
+        if(numChannels == 0)
+            return;
+        if(startEquilibrated)
+            startingProbability = equilibriumProbability(epochs.begin()->uniqueEpochs[variableSetIndex]->transitionRates);
+        Philox4x32 rng(seed);
+        seed = deriveSeed(seed, 1);
+        // Distribute count among categories with given probabilities (sequential conditional binomials).
+        auto addMultinomial = [&rng](long long count, const double *p, int numCategories, std::vector<long long> &counts) {
+            double remainingProbability = 1;
+            for(int j = 0; j < numCategories && count > 0; ++j) {
+                long long m = j + 1 == numCategories ? count : randomBinomial(rng, count, remainingProbability > 0 ? p[j] / remainingProbability : 1);
+                counts[j] += m;
+                count -= m;
+                remainingProbability -= p[j];
+            }
+        };
+        // Initial state occupancy counts.
+        std::vector<long long> n(numStates, 0), nextn(numStates);
+        addMultinomial(numChannels, startingProbability.data(), numStates, n);
+        // Channels are independent, so over an interval dt with constant rates each channel in state i ends up in state j
+        // with probability expm(Q * dt)_ij and the counts are an exact sum of multinomials. This leaps a whole sample interval
+        // at a cost independent of the number of channels. Intervals expected to have only a few transitions are instead
+        // simulated with exact Gillespie steps.
+        const double minTransitionsPerLeap = 10;
+        Eigen::RowVectorXd E_i(numStates);
+        std::vector<double> exitRates(numStates);
+        Epoch *uniqueEpoch = 0;
+        double t = 0;
+        auto advanceTo = [&](double stopTime) {
+            double dt = stopTime - t;
+            if(dt <= 0)
+                return;
+            double a0 = 0;
+            for(int i = 0; i < numStates; ++i)
+                a0 += n[i] * exitRates[i];
+            if(a0 * dt < minTransitionsPerLeap) {
+                // Exact Gillespie steps.
+                while(a0 > 0) {
+                    if(abort && *abort) return;
+                    t += -std::log(1 - rng.uniform()) / a0;
+                    if(t >= stopTime)
+                        break; // Memoryless, so the next interval can start from stopTime.
+                    // Select state to leave.
+                    double r = rng.uniform() * a0;
+                    int i = -1;
+                    for(int k = 0; k < numStates; ++k) {
+                        double a = n[k] * exitRates[k];
+                        if(a <= 0)
+                            continue;
+                        i = k;
+                        if(r < a)
+                            break;
+                        r -= a;
                     }
+                    // Select destination.
+                    int j = uniqueEpoch->jumpTable.nextState(i, rng.uniform());
+                    --n[i];
+                    ++n[j];
+                    a0 += exitRates[j] - exitRates[i];
+                }
+            } else {
+                // Exact multinomial leap.
+                const Eigen::MatrixXd &E = uniqueEpoch->propagators.propagator(uniqueEpoch->transitionRates, dt);
+                std::fill(nextn.begin(), nextn.end(), 0);
+                for(int i = 0; i < numStates; ++i) {
+                    if(n[i] == 0)
+                        continue;
+                    E_i = E.row(i).cwiseMax(0);
+                    E_i /= E_i.sum();
+                    addMultinomial(n[i], E_i.data(), numStates, nextn);
                 }
+                n.swap(nextn);
             }
-        }
-        if(sampleRuns) {
-            size_t numPts = time.size();
-            while(probability.size() <= variableSetIndex)
-                probability.push_back(Eigen::MatrixXd::Zero(numPts, numStates));
-            getProbabilityFromEventChains(probability.at(variableSetIndex), numStates, events.at(variableSetIndex), abort, message);
+            t = stopTime;
+        };
+        for(const Epoch &epoch : epochs) {
+            if(abort && *abort) return;
+            uniqueEpoch = epoch.uniqueEpochs[variableSetIndex];
+            for(int i = 0; i < numStates; ++i)
+                exitRates[i] = uniqueEpoch->jumpTable.exitRate(i);
+            for(int pt = epoch.firstPt; pt < epoch.firstPt + epoch.numPts; ++pt) {
+                advanceTo(time[pt]);
+                for(int i = 0; i < numStates; ++i)
+                    P(pt, i) = double(n[i]) / numChannels;
+            }
+            advanceTo(epoch.start + epoch.duration);
         }
     }
     
-    void Simulation::getProbabilityFromEventChains(Eigen::MatrixXd &P, size_t numStates, const std::vector<MonteCarloEventChain> &eventChains, AbortFlag *abort, QString */* message */)
+    void Simulation::getProbabilityFromEventChains(Eigen::MatrixXd &P, size_t numStates, const MonteCarloEventChains &eventChains, AbortFlag *abort, QString */* message */)
     {
         size_t numPts = time.size();
         P.setZero(numPts, numStates);
-        for(const MonteCarloEventChain &eventChain : eventChains) {
-            size_t t = 0; // Index into time.
-            MonteCarloEventChain::const_iterator eventIter = eventChain.begin();
-            double sampleIntervalStart = time[t];
-            double sampleIntervalEnd = t + 1 >= numPts ? endTime : time[t + 1];
-            double sampleInterval = sampleIntervalEnd - sampleIntervalStart;
-            double eventStart = 0;
-            double eventEnd = eventStart + eventIter->duration;
-            while(t < numPts && eventIter != eventChain.end()) {
-                if(abort && *abort) return;
-                if(eventStart <= sampleIntervalStart && eventEnd >= sampleIntervalEnd) {
-                    // Event covers entire sample interval.
-                    P(t, eventIter->state) += 1;
-                    ++t;
-                    sampleIntervalStart = sampleIntervalEnd;
-                    sampleIntervalEnd = t + 1 < numPts ? time[t + 1] : endTime;
-                    sampleInterval = sampleIntervalEnd - sampleIntervalStart;
-                } else if(eventStart <= sampleIntervalStart) {
-                    // Event stopped mid sample interval.
-                    P(t, eventIter->state) += (eventEnd - sampleIntervalStart) / sampleInterval;
-                    ++eventIter;
-                    if(eventIter == eventChain.end()) break;
-                    eventStart = eventEnd;
-                    eventEnd = eventStart + eventIter->duration;
-                } else if(eventEnd >= sampleIntervalEnd) {
-                    // Event started mid sample interval.
-                    P(t, eventIter->state) += (sampleIntervalEnd - eventStart) / sampleInterval;
-                    ++t;
-                    sampleIntervalStart = sampleIntervalEnd;
-                    sampleIntervalEnd = t + 1 < numPts ? time[t + 1] : endTime;
-                    sampleInterval = sampleIntervalEnd - sampleIntervalStart;
-                } else {
-                    // Event started and stopped mid sample interval.
-                    P(t, eventIter->state) += eventIter->duration / sampleInterval;
-                    ++eventIter;
-                    if(eventIter == eventChain.end()) break;
-                    eventStart = eventEnd;
-                    eventEnd = eventStart + eventIter->duration;
+        for(size_t i = 0; i < eventChains.size(); ++i) {
+            if(abort && *abort) return;
+            accumulateEventChainOccupancy(P, eventChains.at(i));
+        }
+        P /= eventChains.size();
+    }
+    
+    void Simulation::accumulateEventChainOccupancy(Eigen::MatrixXd &P, const MonteCarloEventChains::Chain &eventChain)
+    {
+        size_t numPts = time.size();
+        size_t numEvents = eventChain.size();
+        if(numEvents == 0)
+            return;
+        size_t t = 0; // Index into time.
+        size_t e = 0; // Index into events.
+        double sampleIntervalStart = time[t];
+        double sampleIntervalEnd = t + 1 >= numPts ? endTime : time[t + 1];
+        double sampleInterval = sampleIntervalEnd - sampleIntervalStart;
+        double eventStart = 0;
+        double eventEnd = eventStart + eventChain.duration(e);
+        while(t < numPts && e < numEvents) {
+            int state = eventChain.state(e);
+            if(eventStart <= sampleIntervalStart && eventEnd >= sampleIntervalEnd) {
+                // Event covers entire sample interval.
+                P(t, state) += 1;
+                ++t;
+                sampleIntervalStart = sampleIntervalEnd;
+                sampleIntervalEnd = t + 1 < numPts ? time[t + 1] : endTime;
+                sampleInterval = sampleIntervalEnd - sampleIntervalStart;
+            } else if(eventStart <= sampleIntervalStart) {
+                // Event stopped mid sample interval.
+                P(t, state) += (eventEnd - sampleIntervalStart) / sampleInterval;
+                if(++e == numEvents) break;
+                eventStart = eventEnd;
+                eventEnd = eventStart + eventChain.duration(e);
+            } else if(eventEnd >= sampleIntervalEnd) {
+                // Event started mid sample interval.
+                P(t, state) += (sampleIntervalEnd - eventStart) / sampleInterval;
+                ++t;
+                sampleIntervalStart = sampleIntervalEnd;
+                sampleIntervalEnd = t + 1 < numPts ? time[t + 1] : endTime;
+                sampleInterval = sampleIntervalEnd - sampleIntervalStart;
+            } else {
+                // Event started and stopped mid sample interval.
+                P(t, state) += eventChain.duration(e) / sampleInterval;
+                if(++e == numEvents) break;
+                eventStart = eventEnd;
+                eventEnd = eventStart + eventChain.duration(e);
+            }
+        }
+    }
+    
+    double Simulation::cost(size_t variableSetIndex, const Eigen::MatrixXd *probability) const
+    {
+        double cost = 0;
+        if(referenceData.size() <= variableSetIndex)
+            return cost;
+        int numPts = time.size();
+        if(!probability && this->probability.size() > variableSetIndex)
+            probability = &this->probability.at(variableSetIndex);
+        for(auto &kv : referenceData.at(variableSetIndex)) {
+            const RefData &refData = kv.second;
+            if(refData.numPts <= 0)
+                continue;
+            // Same lookup order as StimulusClampProtocol::getSimulationWaveform, but with the state index already resolved.
+            const double *y = 0;
+            if(refData.stateIndex != -1) {
+                if(probability && probability->rows() == numPts && probability->cols() > refData.stateIndex)
+                    y = probability->col(refData.stateIndex).data();
+            } else {
+                auto stimulusIter = stimuli.find(kv.first);
+                if(stimulusIter != stimuli.end()) {
+                    y = stimulusIter->second.data();
+                } else if(waveforms.size() > variableSetIndex) {
+                    auto waveformIter = waveforms.at(variableSetIndex).find(kv.first);
+                    if(waveformIter != waveforms.at(variableSetIndex).end())
+                        y = waveformIter->second.data();
                 }
             }
+            if(y) {
+                Eigen::Map<const Eigen::VectorXd> data(y + refData.firstPt, refData.numPts);
+                Eigen::Map<const Eigen::VectorXd> weights(weight.data() + refData.firstPt, refData.numPts);
+                cost += ((data - refData.waveform).array().square() * weights.array()).sum() * refData.weight;
+            }
         }
-        P /= eventChains.size();
+        return cost;
     }
     
     double Simulation::maxProbabilityError()
@@ -527,7 +1179,7 @@ namespace StimulusClampProtocol
     void ReferenceData::open(QString filePath)
     {
         if(filePath.isEmpty()) {
-            filePath = QFileDialog::getOpenFileName(0, "Open reference data file...");
+            filePath = UserPrompts::getOpenFileName("Open reference data file...");
             if(filePath.isEmpty()) return;
         }
         QFileInfo fileInfo(filePath);
@@ -536,7 +1188,7 @@ namespace StimulusClampProtocol
             filePath = protocol->fileInfo().absoluteDir().filePath(filePath);
         QFile file(filePath);
         if(!file.open(QIODevice::Text | QIODevice::ReadOnly)) {
-            QMessageBox::information(0, "error", file.errorString() + ": " + filePath);
+            UserPrompts::showErrorMessage(file.errorString() + ": " + filePath);
             return;
         }
         QTextStream in(&file);
@@ -555,7 +1207,7 @@ namespace StimulusClampProtocol
                 colData[col].push_back(col < fields.size() ? fields[col].toDouble(&ok) : 0);
                 if(!ok) {
                     file.close();
-                    QMessageBox::information(0, "error", "Non-numeric data '" + fields[col] + "'.");
+                    UserPrompts::showErrorMessage("Non-numeric data '" + fields[col] + "'.");
                     return;
                 }
             }
@@ -595,14 +1247,18 @@ namespace StimulusClampProtocol
     _duration("1"),
     _sampleInterval("0.001"),
     _weight("1"),
-    _startEquilibrated(false)
+    _startEquilibrated(false),
+    _randomSeed(0)
     {
         setName(name);
     }
     
-    void StimulusClampProtocol::init(std::vector<Epoch*> &uniqueEpochs, const QStringList &stateNames)
+    void StimulusClampProtocol::init(std::vector<std::vector<Epoch*> > &uniqueEpochs, const QStringList &stateNames, uint64_t randomSeed, MarkovModel::MarkovModel *model)
     {
         this->stateNames = stateNames;
+        bool reseed = !model || model != _randomSeedModel.data() || randomSeed != _randomSeed;
+        _randomSeed = randomSeed;
+        _randomSeedModel = model;
         QList<Stimulus*> stimuli = findChildren<Stimulus*>(QString(), Qt::FindDirectChildrenOnly);
         QList<SimulationsSummary*> summaries = findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly);
         
@@ -632,6 +1288,32 @@ namespace StimulusClampProtocol
                 summary->durationYs = str2mat<double>(summary->durationY());
             }
         }
+        waveformExprSymbols.clear();
+        waveformParameters.clear();
+        foreach(Waveform *waveform, findChildren<Waveform*>(QString(), Qt::FindDirectChildrenOnly)) {
+            if(waveform->isActive())
+                MarkovModel::addExprSymbols(waveform->expr(), waveformExprSymbols);
+        }
+        foreach(SimulationsSummary *summary, summaries) {
+            if(summary->isActive()) {
+                MarkovModel::addExprSymbols(summary->exprX(), waveformExprSymbols);
+                MarkovModel::addExprSymbols(summary->exprY(), waveformExprSymbols);
+            }
+        }
+        exprSymbols.clear();
+        for(const QString &name : waveformExprSymbols) {
+            ExprSymbol symbol;
+            symbol.name = name;
+            symbol.key = name.toStdString();
+            symbol.stateIndex = stateNames.indexOf(name);
+            exprSymbols.push_back(symbol);
+        }
+        foreach(Waveform *waveform, findChildren<Waveform*>(QString(), Qt::FindDirectChildrenOnly)) {
+            waveform->parsedExpr = waveform->expr().toStdString();
+            waveform->exprSymbolIndex = std::distance(waveformExprSymbols.begin(), waveformExprSymbols.find(waveform->name()));
+            if(waveform->exprSymbolIndex == int(exprSymbols.size()))
+                waveform->exprSymbolIndex = -1;
+        }
         // Get max size for all conditions matrices.
         size_t rows = 1, cols = 1;
         matlims<double>(starts, &rows, &cols);
@@ -687,13 +1369,24 @@ namespace StimulusClampProtocol
             for(size_t col = 0; col < cols; ++col) {
                 Simulation &sim = simulations[row][col];
                 // Clear arrays.
-                sim.probability.clear();
                 sim.waveforms.clear();
+                sim.isUpToDate.clear();
+                sim.costs.clear();
                 // Sample time points.
+                Eigen::VectorXd prevTime = sim.time;
+                double prevEndTime = sim.endTime;
+                sim.sampleInterval = sampleIntervals[row][col];
                 int numSteps = floor(durations[row][col] / sampleIntervals[row][col]);
                 sim.time = Eigen::VectorXd::LinSpaced(1 + numSteps, starts[row][col], starts[row][col] + numSteps * sampleIntervals[row][col]);
                 sim.endTime = starts[row][col] + durations[row][col];
                 int numPts = sim.time.size();
+                // Accumulated Monte Carlo runs are carried over along with their event chains and probability
+                // as long as they were simulated for the same sample points.
+                if(prevTime.size() != numPts || prevTime != sim.time || prevEndTime != sim.endTime) {
+                    sim.probability.clear();
+                    sim.events.clear();
+                    sim.numMonteCarloRuns.clear();
+                }
                 // Sample weights.
                 sim.weight = Eigen::VectorXd::Constant(numPts, weights[row][col]);
                 // Stimulus waveforms (plus weight and mask).
@@ -715,24 +1408,34 @@ namespace StimulusClampProtocol
                 sim.mask = (mask.array() == 0);
                 // Stimulus epochs.
                 sim.findEpochsDiscretizedToSamplePoints();
-                // Unique epochs.
+                // Unique epochs (a separate copy for each variable set).
                 for(Epoch &epoch : sim.epochs) {
-                    bool foundIt = false;
-                    for(Epoch *uniqueEpoch : uniqueEpochs) {
-                        if(uniqueEpoch->stimuli == epoch.stimuli) {
-                            epoch.uniqueEpoch = uniqueEpoch;
-                            foundIt = true;
+                    epoch.uniqueEpochs.clear();
+                    for(size_t i = 0; i < uniqueEpochs.at(0).size(); ++i) {
+                        if(uniqueEpochs.at(0).at(i)->stimuli == epoch.stimuli) {
+                            for(std::vector<Epoch*> &variableSetUniqueEpochs : uniqueEpochs)
+                                epoch.uniqueEpochs.push_back(variableSetUniqueEpochs.at(i));
                             break;
                         }
                     }
-                    if(!foundIt) {
-                        epoch.uniqueEpoch = new Epoch;
-                        epoch.uniqueEpoch->stimuli = epoch.stimuli;
-                        uniqueEpochs.push_back(epoch.uniqueEpoch);
+                    if(epoch.uniqueEpochs.empty()) {
+                        for(std::vector<Epoch*> &variableSetUniqueEpochs : uniqueEpochs) {
+                            Epoch *uniqueEpoch = new Epoch;
+                            uniqueEpoch->stimuli = epoch.stimuli;
+                            variableSetUniqueEpochs.push_back(uniqueEpoch);
+                            epoch.uniqueEpochs.push_back(uniqueEpoch);
+                        }
                     }
+                    // Sample interval propagators needed for this epoch (computed only for the matrix exponential method).
+                    for(Epoch *uniqueEpoch : epoch.uniqueEpochs)
+                        uniqueEpoch->sampleIntervals.insert(sim.sampleInterval);
+                }
+                // Random number seed for each variable set.
+                if(reseed || sim.randomSeeds.size() != uniqueEpochs.size()) {
+                    sim.randomSeeds.clear();
+                    for(size_t i = 0; i < uniqueEpochs.size(); ++i)
+                        sim.randomSeeds.push_back(deriveSeed(deriveSeed(deriveSeed(randomSeed, row), col), i));
                 }
-                // Random number generator.
-                sim.randomNumberGenerator = getSeededRandomNumberGenerator<std::mt19937>();
                 // Summary sample indexes.
                 foreach(SimulationsSummary *summary, summaries) {
                     if(summary->isActive()) {
@@ -802,6 +1505,7 @@ namespace StimulusClampProtocol
                             if(referenceData->scale() != 1)
                                 refData.waveform *= referenceData->scale();
                             refData.weight = referenceData->weight();
+                            refData.stateIndex = stateNames.indexOf(referenceData->name());
                             sim.referenceData.at(varSet)[referenceData->name()] = refData;
                         }
                     } // i
@@ -812,26 +1516,13 @@ namespace StimulusClampProtocol
     
     double StimulusClampProtocol::cost()
     {
+        // Simulation costs are computed concurrently by the tasks that evaluated each simulation's waveforms
+        // (see StimulusClampProtocolSimulator::runSimulation), and are summed here in a fixed order.
         double cost = 0;
-        for(size_t row = 0; row < simulations.size(); ++row) {
-            for(size_t col = 0; col < simulations[row].size(); ++col) {
-                Simulation &sim = simulations[row][col];
-                for(size_t variableSetIndex = 0; variableSetIndex < sim.referenceData.size(); ++variableSetIndex) {
-                    for(auto &kv : sim.referenceData.at(variableSetIndex)) {
-                        Simulation::RefData &refData = kv.second;
-                        if(refData.numPts > 0) {
-                            double *x = 0;
-                            double *y = 0;
-                            int n;
-                            getSimulationWaveform(kv.first, sim, variableSetIndex, &x, &y, &n);
-                            if(x && y && n > 0) {
-                                Eigen::Map<Eigen::VectorXd> data(y + refData.firstPt, refData.numPts);
-                                Eigen::Map<Eigen::VectorXd> weight(sim.weight.data() + refData.firstPt, refData.numPts);
-                                cost += ((data - refData.waveform).array().pow(2) * weight.array()).sum() * refData.weight;
-                            }
-                        }
-                    }
-                }
+        for(const std::vector<Simulation> &simulationsRow : simulations) {
+            for(const Simulation &sim : simulationsRow) {
+                for(double simCost : sim.costs)
+                    cost += simCost;
             }
         }
         foreach(SimulationsSummary *summary, findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly)) {
@@ -842,7 +1533,7 @@ namespace StimulusClampProtocol
                         if(refData.numPts > 0) {
                             SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
                             Eigen::Map<Eigen::RowVectorXd> data(dataY.row(row).data() + refData.firstPt, refData.numPts);
-                            cost += ((data - refData.waveform).array().pow(2)).sum() * refData.weight;
+                            cost += (data - refData.waveform).squaredNorm() * refData.weight;
                         }
                     }
                 }
@@ -944,7 +1635,7 @@ namespace StimulusClampProtocol
     void StimulusClampProtocol::open(QString filePath)
     {
         if(filePath.isEmpty())
-            filePath = QFileDialog::getOpenFileName(0, "Open Stimulus Clamp Protocol...", _fileInfo.absoluteFilePath());
+            filePath = UserPrompts::getOpenFileName("Open Stimulus Clamp Protocol...", _fileInfo.absoluteFilePath());
         if(filePath.isEmpty())
             return;
         QFile file(filePath);
@@ -966,7 +1657,7 @@ namespace StimulusClampProtocol
     void StimulusClampProtocol::saveAs(QString filePath)
     {
         if(filePath.isEmpty())
-            filePath = QFileDialog::getSaveFileName(0, "Save Stimulus Clamp Protocol...", _fileInfo.absoluteFilePath());
+            filePath = UserPrompts::getSaveFileName("Save Stimulus Clamp Protocol...", _fileInfo.absoluteFilePath());
         if(filePath.isEmpty())
             return;
         QFile file(filePath);
@@ -991,7 +1682,7 @@ namespace StimulusClampProtocol
         // 1    21
         // 0    56
         if(filePath.isEmpty())
-            filePath = QFileDialog::getSaveFileName(0, "Save Monte Carlo event chains (*.dwt)...");
+            filePath = UserPrompts::getSaveFileName("Save Monte Carlo event chains (*.dwt)...");
         if(filePath.endsWith(".dwt"))
             filePath.chop(4);
         if(filePath.isEmpty())
@@ -1005,10 +1696,12 @@ namespace StimulusClampProtocol
                         return;
                     QTextStream out(&file);
                     int segment = 1;
-                    foreach(const MonteCarloEventChain &eventChain, sim.events.at(variableSetIndex)) {
+                    const MonteCarloEventChains &eventChains = sim.events.at(variableSetIndex);
+                    for(size_t i = 0; i < eventChains.size(); ++i) {
+                        MonteCarloEventChains::Chain eventChain = eventChains.at(i);
                         out << "Segment: " << segment << " Dwells: " << eventChain.size() - 1 << " Sampling(ms): 1\r\n";
-                        foreach(const MonteCarloEvent &event, eventChain)
-                            out << event.state << "\t" << event.duration * 1000 << "\r\n";
+                        for(size_t j = 0; j < eventChain.size(); ++j)
+                            out << eventChain.state(j) << "\t" << eventChain.duration(j) * 1000 << "\r\n";
                         out << "\r\n";
                         ++segment;
                     }
@@ -1018,274 +1711,365 @@ namespace StimulusClampProtocol
         }
     }
     
-    StimulusClampProtocolSimulator::StimulusClampProtocolSimulator(const QString &labelText, QWidget *parent) :
-    QProgressDialog(labelText, "Abort", 0, 0, parent),
+    void StimulusClampProtocol::saveSimulationsAsText(QString filePath)
+    {
+        // One file per simulation with columns: time, stimuli, state probabilities, waveforms.
+        // One file per summary with an X and Y column for each row.
+        if(filePath.isEmpty())
+            filePath = UserPrompts::getSaveFileName("Save simulations (*.txt)...");
+        if(filePath.endsWith(".txt"))
+            filePath.chop(4);
+        if(filePath.isEmpty())
+            return;
+        for(size_t row = 0; row < simulations.size(); ++row) {
+            for(size_t col = 0; col < simulations[row].size(); ++col) {
+                Simulation &sim = simulations[row][col];
+                for(size_t variableSetIndex = 0; variableSetIndex < sim.probability.size(); ++variableSetIndex) {
+                    QStringList names;
+                    std::vector<const double*> columns;
+                    names << "t";
+                    columns.push_back(sim.time.data());
+                    for(auto &kv : sim.stimuli) {
+                        names << kv.first;
+                        columns.push_back(kv.second.data());
+                    }
+                    const Eigen::MatrixXd &probability = sim.probability.at(variableSetIndex);
+                    if(probability.rows() == sim.time.size() && probability.cols() == stateNames.size()) {
+                        for(int i = 0; i < stateNames.size(); ++i) {
+                            names << stateNames.at(i);
+                            columns.push_back(probability.col(i).data());
+                        }
+                    }
+                    if(sim.waveforms.size() > variableSetIndex) {
+                        for(auto &kv : sim.waveforms.at(variableSetIndex)) {
+                            if(kv.second.size() == sim.time.size()) {
+                                names << kv.first;
+                                columns.push_back(kv.second.data());
+                            }
+                        }
+                    }
+                    QFile file(filePath + " (" + QString::number(variableSetIndex) + "," + QString::number(row) + "," + QString::number(col) + ").txt");
+                    if(!file.open(QIODevice::Text | QIODevice::WriteOnly))
+                        return;
+                    QTextStream out(&file);
+                    out << names.join("\t") << "\n";
+                    for(int pt = 0; pt < sim.time.size(); ++pt) {
+                        for(size_t j = 0; j < columns.size(); ++j)
+                            out << (j ? "\t" : "") << QString::number(columns[j][pt], 'g', 12);
+                        out << "\n";
+                    }
+                    file.close();
+                }
+            }
+        }
+        foreach(SimulationsSummary *summary, findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly)) {
+            if(summary->isActive()) {
+                for(size_t variableSetIndex = 0; variableSetIndex < summary->dataX.size() && variableSetIndex < summary->dataY.size(); ++variableSetIndex) {
+                    const SimulationsSummary::RowMajorMatrixXd &dataX = summary->dataX.at(variableSetIndex);
+                    const SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
+                    if(dataX.rows() != dataY.rows() || dataX.cols() != dataY.cols())
+                        continue;
+                    QFile file(filePath + " " + summary->name() + " (" + QString::number(variableSetIndex) + ").txt");
+                    if(!file.open(QIODevice::Text | QIODevice::WriteOnly))
+                        return;
+                    QTextStream out(&file);
+                    for(int row = 0; row < dataX.rows(); ++row)
+                        out << (row ? "\t" : "") << "X" << row << "\tY" << row;
+                    out << "\n";
+                    for(int col = 0; col < dataX.cols(); ++col) {
+                        for(int row = 0; row < dataX.rows(); ++row)
+                            out << (row ? "\t" : "") << QString::number(dataX(row, col), 'g', 12) << "\t" << QString::number(dataY(row, col), 'g', 12);
+                        out << "\n";
+                    }
+                    file.close();
+                }
+            }
+        }
+    }
+    
+    QString SimulationProfile::stageName(int stage)
+    {
+        switch(stage) {
+            case RunSimulation: return "Run simulation";
+            case RateEvaluation: return "Rate evaluation";
+            case EigenDecomposition: return "Eigen decomposition";
+            case MatrixExponentials: return "Matrix exponentials";
+            case CellSimulation: return "Cell simulation";
+            case EventChainSampling: return "Event chain sampling";
+            case Waveforms: return "Waveforms";
+            case Summaries: return "Summaries";
+            case Cost: return "Cost";
+            default: return "";
+        }
+    }
+    
+    void SimulationProfile::clear()
+    {
+        for(int stage = 0; stage < NumStages; ++stage) {
+            nsecs[stage] = 0;
+            counts[stage] = 0;
+        }
+    }
+    
+    QString SimulationProfile::toString() const
+    {
+        QStringList stages;
+        for(int stage = 0; stage < NumStages; ++stage) {
+            if(counts[stage])
+                stages << stageName(stage) + " " + QString::number(milliseconds(stage), 'g', 4) + " ms (" + QString::number(counts[stage].load()) + ")";
+        }
+        return stages.join(", ");
+    }
+    
+    QVariantMap SimulationProfile::toVariantMap() const
+    {
+        QVariantMap data;
+        for(int stage = 0; stage < NumStages; ++stage) {
+            QVariantMap stageData;
+            stageData["ms"] = milliseconds(stage);
+            stageData["count"] = counts[stage].load();
+            data[stageName(stage)] = stageData;
+        }
+        return data;
+    }
+    
+    StimulusClampProtocolSimulator::StimulusClampProtocolSimulator(QObject *parent) :
+    QObject(parent),
     model(0),
     abort(false),
     minimizer(0),
     x(0),
     dx(0)
     {
-        connect(this, SIGNAL(canceled()), this, SLOT(_abort()));
-        connect(&_watcher, SIGNAL(finished()), this, SLOT(_finish()));
-        connect(this, SIGNAL(iterationChanged(int)), this, SLOT(_atIteration(int)));
-        setWindowModality(Qt::WindowModality::ApplicationModal);
     }
     
     StimulusClampProtocolSimulator::~StimulusClampProtocolSimulator()
     {
-        for(Epoch *epoch : uniqueEpochs) delete epoch;
+        for(std::vector<Epoch*> &variableSetUniqueEpochs : uniqueEpochs) {
+            for(Epoch *epoch : variableSetUniqueEpochs)
+                delete epoch;
+        }
         if(minimizer) gsl_multimin_fminimizer_free(minimizer);
         if(x) gsl_vector_free(x);
         if(dx) gsl_vector_free(dx);
     }
     
-    void StimulusClampProtocolSimulator::simulate(bool showProgressDialog)
+    void StimulusClampProtocolSimulator::initSimulation()
     {
-        setRange(0, 0); // Infinite wait progress bar.
-        if(showProgressDialog)
-            QTimer::singleShot(2000, this, SLOT(show())); // Show dialog after 2000 ms.
-        try {
-            initSimulation();
-            _future = QtConcurrent::run(static_cast<StimulusClampProtocolSimulator*>(this), &StimulusClampProtocolSimulator::runSimulation);
-            _watcher.setFuture(_future);
-        } catch(std::runtime_error &e) {
-            message = QString(e.what());
-            _finish();
-        } catch(...) {
-            message = "Undocumentded error.";
-            _finish();
+        profile.clear();
+        model->init(stateNames);
+        model->getExprSymbols(modelExprSymbols);
+        if(options.contains("Lump equivalent states") && options["Lump equivalent states"].toBool())
+            model->getStateLumping(stateLumping);
+        else
+            stateLumping.clear();
+        for(std::vector<Epoch*> &variableSetUniqueEpochs : uniqueEpochs) {
+            for(Epoch *epoch : variableSetUniqueEpochs)
+                delete epoch;
         }
+        uniqueEpochs.clear();
+        uniqueEpochs.resize(std::max(size_t(1), model->numVariableSets()));
+        // Random number substreams are derived from (seed, protocol, row, col, variable set, run),
+        // so that simulations with the same nonnegative seed are reproducible. Protocols only rederive them
+        // when the seed or model changes (see StimulusClampProtocol::init).
+        qlonglong seed = options.contains("Random seed") ? options["Random seed"].toLongLong() : -1;
+        uint64_t randomSeed = seed >= 0 ? uint64_t(seed) : nondeterministicSeed();
+        for(size_t i = 0; i < protocols.size(); ++i)
+            protocols.at(i)->init(uniqueEpochs, stateNames, deriveSeed(randomSeed, i), model);
     }
     
-    void StimulusClampProtocolSimulator::initSimulation()
+    // Whether any of the simulation's unique epochs changed during their last evaluation.
+    static bool hasChangedEpochs(const Simulation &sim, size_t variableSetIndex)
     {
-        model->init(stateNames);
-        for(Epoch *epoch : uniqueEpochs)
-            delete epoch;
-        uniqueEpochs.clear();
-        foreach(StimulusClampProtocol *protocol, protocols)
-            protocol->init(uniqueEpochs, stateNames);
+        for(const Epoch &epoch : sim.epochs) {
+            if(epoch.uniqueEpochs[variableSetIndex]->changed)
+                return true;
+        }
+        return false;
     }
     
     void StimulusClampProtocolSimulator::runSimulation()
     {
+        SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::RunSimulation);
         try {
-            QList<MarkovModel::StateGroup*> stateGroups = model->findChildren<MarkovModel::StateGroup*>(QString(), Qt::FindDirectChildrenOnly);
-            QString method = options["Method"].toString();
-            std::vector<QFuture<void> > futures;
-            for(size_t variableSetIndex = 0; variableSetIndex < model->numVariableSets(); ++variableSetIndex) {
-                // Unique epochs.
-                for(Epoch *epoch : uniqueEpochs) {
-                    if(abort) break;
-                    model->evalVariables(epoch->stimuli, variableSetIndex);
-                    model->getStateProbabilities(epoch->stateProbabilities);
-                    model->getStateAttributes(epoch->stateAttributes);
-                    model->getTransitionRates(epoch->transitionRates);
-                    model->getTransitionCharges(epoch->transitionCharges);
-                    int numStates = epoch->transitionRates.cols();
-                    if(method == "Eigen Solver") {
-                        std::function<void()> func = std::bind(spectralExpansion, std::ref(epoch->transitionRates), std::ref(epoch->spectralEigenValues), std::ref(epoch->spectralMatrices), &abort);
-                        futures.push_back(QtConcurrent::run(func));
-                    } else if(method == "Monte Carlo") {
-                        epoch->spectralEigenValues = Eigen::VectorXd::Zero(1);
-                        epoch->spectralMatrices.clear();
-                        epoch->randomStateLifetimes.clear();
-                        epoch->randomStateLifetimes.reserve(numStates);
-                        for(int i = 0; i < numStates; ++i)
-                            epoch->randomStateLifetimes.push_back(std::exponential_distribution<double>(-epoch->transitionRates.coeff(i, i)));
+            // Allocate memory for all variable sets up front so that they can be simulated concurrently.
+            size_t numVariableSets = uniqueEpochs.size();
+            for(StimulusClampProtocol *protocol : protocols) {
+                size_t rows = protocol->simulations.size();
+                size_t cols = rows ? protocol->simulations[0].size() : 0;
+                for(size_t row = 0; row < rows; ++row) {
+                    for(size_t col = 0; col < cols; ++col) {
+                        Simulation &sim = protocol->simulations[row][col];
+                        if(sim.probability.size() < numVariableSets)
+                            sim.probability.resize(numVariableSets);
+                        if(sim.waveforms.size() < numVariableSets)
+                            sim.waveforms.resize(numVariableSets);
+                        if(sim.events.size() < numVariableSets)
+                            sim.events.resize(numVariableSets);
+                        if(sim.numMonteCarloRuns.size() < numVariableSets)
+                            sim.numMonteCarloRuns.resize(numVariableSets, 0);
+                        if(sim.isUpToDate.size() < numVariableSets)
+                            sim.isUpToDate.resize(numVariableSets, false);
+                        if(sim.costs.size() < numVariableSets)
+                            sim.costs.resize(numVariableSets, 0);
                     }
-                    if(epoch->transitionCharges.nonZeros())
-                        epoch->stateChargeCurrents = epoch->transitionRates.cwiseProduct(epoch->transitionCharges).toDense().rowwise().sum() * 6.242e-6; // pA = 6.242e-6 e/s
-                    else
-                        epoch->stateChargeCurrents = Eigen::RowVectorXd::Zero(numStates);
-                } // epoch
-                for(QFuture<void> &future : futures)
-                    future.waitForFinished();
-                futures.clear();
-                // Simulations.
-                int numRuns = options.contains("# Monte Carlo runs") ? options["# Monte Carlo runs"].toInt() : 0;
-                bool accumulateRuns = options.contains("Accumulate Monte Carlo runs") ? options["Accumulate Monte Carlo runs"].toBool() : false;
-                bool sampleRuns = options.contains("Sample probability from Monte Carlo event chains") ? options["Sample probability from Monte Carlo event chains"].toBool() : true;
-                for(StimulusClampProtocol *protocol : protocols) {
-                    for(size_t row = 0; row < protocol->simulations.size(); ++row) {
-                        for(size_t col = 0; col < protocol->simulations[row].size(); ++col) {
-                            if(abort) break;
-                            Simulation &sim = protocol->simulations[row][col];
-                            if(method == "Eigen Solver") {
-                                std::function<void()> func = std::bind(&Simulation::spectralSimulation, &sim, sim.epochs.begin()->uniqueEpoch->stateProbabilities, protocol->startEquilibrated(), variableSetIndex, &abort, &message);
-                                futures.push_back(QtConcurrent::run(func));
-                            } else if(method == "Monte Carlo") {
-                                std::function<void()> func = std::bind(&Simulation::monteCarloSimulation, &sim, sim.epochs.begin()->uniqueEpoch->stateProbabilities, std::ref(sim.randomNumberGenerator), numRuns, accumulateRuns, sampleRuns, protocol->startEquilibrated(), variableSetIndex, &abort, &message);
-                                futures.push_back(QtConcurrent::run(func));
-                            }
-                        } // col
-                    } // row
-                } // protocol
-                for(QFuture<void> &future : futures)
-                    future.waitForFinished();
-                futures.clear();
-                // State groups, waveforms and summaries.
-                EigenLab::ParserXd parser;
-                for(StimulusClampProtocol *protocol : protocols) {
-                    size_t rows = protocol->simulations.size();
-                    size_t cols = rows ? protocol->simulations[0].size() : 0;
-                    // Allocate memory for summaries.
-                    QList<SimulationsSummary*> summaries = protocol->findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly);
-                    foreach(SimulationsSummary *summary, summaries) {
-                        if(summary->isActive()) {
-                            while(summary->dataX.size() <= variableSetIndex)
-                                summary->dataX.push_back(SimulationsSummary::RowMajorMatrixXd::Zero(rows, cols));
-                            while(summary->dataY.size() <= variableSetIndex)
-                                summary->dataY.push_back(SimulationsSummary::RowMajorMatrixXd::Zero(rows, cols));
-                            SimulationsSummary::RowMajorMatrixXd &dataX = summary->dataX.at(variableSetIndex);
-                            SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
-                            dataX = SimulationsSummary::RowMajorMatrixXd::Zero(rows, cols);
-                            dataY = SimulationsSummary::RowMajorMatrixXd::Zero(rows, cols);
-                            if(summary->referenceData.size() < model->numVariableSets())
-                                summary->referenceData.resize(model->numVariableSets());
+                }
+                if(protocol->waveformParameters.size() < numVariableSets)
+                    protocol->waveformParameters.resize(numVariableSets);
+                foreach(SimulationsSummary *summary, protocol->findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly)) {
+                    if(summary->isActive()) {
+                        if(summary->dataX.size() < numVariableSets)
+                            summary->dataX.resize(numVariableSets);
+                        if(summary->dataY.size() < numVariableSets)
+                            summary->dataY.resize(numVariableSets);
+                        if(summary->referenceData.size() < numVariableSets)
+                            summary->referenceData.resize(numVariableSets);
+                        for(size_t variableSetIndex = 0; variableSetIndex < numVariableSets; ++variableSetIndex) {
+                            // !!! Summaries of protocols that have not changed are kept from the previous run.
+                            if(summary->dataX.at(variableSetIndex).rows() != int(rows) || summary->dataX.at(variableSetIndex).cols() != int(cols))
+                                summary->dataX.at(variableSetIndex).setZero(rows, cols);
+                            if(summary->dataY.at(variableSetIndex).rows() != int(rows) || summary->dataY.at(variableSetIndex).cols() != int(cols))
+                                summary->dataY.at(variableSetIndex).setZero(rows, cols);
                             if(summary->referenceData.at(variableSetIndex).size() < rows)
                                 summary->referenceData.at(variableSetIndex).resize(rows);
                             for(size_t row = 0; row < rows; ++row)
                                 summary->referenceData.at(variableSetIndex).at(row).numPts = 0;
                         }
                     }
-                    for(size_t row = 0; row < rows; ++row) {
-                        for(size_t col = 0; col < cols; ++col) {
-                            if(abort) break;
-                            Simulation &sim = protocol->simulations[row][col];
-                            int numPts = sim.time.size();
-                            int numStates = sim.epochs.begin()->uniqueEpoch->transitionRates.cols();
-                            // Probability ptr.
-                            Eigen::MatrixXd *probability = 0;
-                            if(sim.probability.size() > variableSetIndex)
-                                probability = &sim.probability.at(variableSetIndex);
-                            if(probability && (probability->rows() != numPts || probability->cols() != numStates))
-                                probability = 0;
-                            Eigen::MatrixXd tempProbability;
-                            if(!probability && method == "Monte Carlo" && sim.events.size() > variableSetIndex) {
-                                sim.getProbabilityFromEventChains(tempProbability, numStates, sim.events.at(variableSetIndex), &abort, &message);
-                                probability = &tempProbability;
-                            }
-                            // Waveforms ref.
-                            if(sim.waveforms.size() < model->numVariableSets())
-                                sim.waveforms.resize(model->numVariableSets());
-                            std::map<QString, Eigen::VectorXd> &waveforms = sim.waveforms.at(variableSetIndex);
-                            // State attributes.
-                            if(probability) {
-                                for(Epoch &epoch : sim.epochs) {
-                                    for(auto &kv : epoch.uniqueEpoch->stateAttributes) {
-                                        QString attrName = kv.first;
-                                        Eigen::RowVectorXd &stateAttrValues = kv.second;
-                                        if(waveforms.find(attrName) == waveforms.end())
-                                            waveforms[attrName] = Eigen::VectorXd::Zero(numPts);
-                                        waveforms[attrName].segment(epoch.firstPt, epoch.numPts) = probability->block(epoch.firstPt, 0, epoch.numPts, numStates) * stateAttrValues.transpose();
-                                    }
-                                }
-                            }
-                            // Parser
-                            parser.vars().clear();
-                            for(auto &kv : model->parameters)
-                                parser.var(kv.first.toStdString()).setLocal(kv.second);
-                            parser.var("t").setShared(sim.time);
-                            for(auto &kv : sim.stimuli)
-                                parser.var(kv.first.toStdString()).setShared(kv.second.data(), numPts, 1);
-                            if(probability) {
-                                for(int i = 0; i < numStates; ++i)
-                                    parser.var(stateNames.at(i).toStdString()).setShared(probability->col(i).data(), numPts, 1);
-                            }
-                            for(auto &kv : waveforms)
-                                parser.var(kv.first.toStdString()).setShared(kv.second.data(), numPts, 1);
-                            // State groups.
-                            if(probability) {
-                                foreach(MarkovModel::StateGroup *stateGroup, stateGroups) {
-                                    if(stateGroup->isActive()) {
-                                        waveforms[stateGroup->name()] = Eigen::VectorXd::Zero(numPts);
-                                        Eigen::VectorXd &waveform = waveforms.at(stateGroup->name());
-                                        for(int stateIndex : stateGroup->stateIndexes)
-                                            waveform += probability->col(stateIndex);
-                                        parser.var(stateGroup->name().toStdString()).setShared(waveform.data(), numPts, 1);
-                                    }
-                                }
-                            }
-                            // Waveforms.
-                            foreach(Waveform *waveform, protocol->findChildren<Waveform*>(QString(), Qt::FindDirectChildrenOnly)) {
-                                if(abort) break;
-                                if(waveform->isActive()) {
-                                    EigenLab::ValueXd result = parser.eval(waveform->expr().toStdString());
-                                    if(result.matrix().rows() != numPts || result.matrix().cols() != 1)
-                                        throw std::runtime_error("Invalid dimensions for waveform '" + waveform->expr().toStdString() + "'.");
-                                    waveforms[waveform->name()] = result.matrix();
-                                    parser.var(waveform->name().toStdString()).setShared(waveforms.at(waveform->name()).data(), numPts, 1);
-                                }
+                }
+            }
+            // Task graph: each simulation starts as soon as its own unique epochs are ready, and its waveforms and summaries
+            // are evaluated as soon as it finishes. Each variable set has its own expression evaluator and unique epochs,
+            // so variable sets are simulated concurrently.
+            // Only unique epochs whose expression symbol values changed are recomputed, only simulations that step through
+            // a changed unique epoch are rerun, and only protocols with a rerun simulation or changed waveform or summary
+            // symbol values are re-evaluated (e.g. when optimizing a variable that only affects some protocols).
+            // Stochastic methods are always rerun.
+            QList<MarkovModel::StateGroup*> stateGroups = model->findChildren<MarkovModel::StateGroup*>(QString(), Qt::FindDirectChildrenOnly);
+            QString method = options["Method"].toString();
+            int numRuns = options.contains("# Monte Carlo runs") ? options["# Monte Carlo runs"].toInt() : 0;
+            bool accumulateRuns = options.contains("Accumulate Monte Carlo runs") ? options["Accumulate Monte Carlo runs"].toBool() : false;
+            bool sampleRuns = options.contains("Sample probability from Monte Carlo event chains") ? options["Sample probability from Monte Carlo event chains"].toBool() : true;
+            int numEventChainsToKeep = options.contains("# Monte Carlo event chains to keep") ? options["# Monte Carlo event chains to keep"].toInt() : -1;
+            int numChannels = options.contains("# Channels") ? options["# Channels"].toInt() : 1;
+            bool stochastic = method == "Monte Carlo" || method == "Stochastic Ensemble";
+            const MarkovModel::StateLumping *lumping = stateLumping.isReduced() ? &stateLumping : 0;
+            std::vector<MarkovModel::MarkovModel::Evaluator> evaluators(numVariableSets);
+            std::vector<std::vector<char> > protocolChanged(numVariableSets, std::vector<char>(protocols.size(), true)); // [variable set][protocol]
+            TaskGraph graph;
+            for(size_t variableSetIndex = 0; variableSetIndex < numVariableSets; ++variableSetIndex) {
+                MarkovModel::MarkovModel::Evaluator *evaluator = &evaluators.at(variableSetIndex);
+                // Unique epochs.
+                TaskGraph::TaskId evalTask = graph.addTask([this, variableSetIndex, method, evaluator]() { evalUniqueEpochs(variableSetIndex, method, *evaluator); });
+                std::map<Epoch*, TaskGraph::TaskId> epochTasks;
+                for(Epoch *epoch : uniqueEpochs.at(variableSetIndex)) {
+                    if(method == "Eigen Solver") {
+                        epochTasks[epoch] = graph.addTask([this, epoch]() {
+                            if(!epoch->changed) return;
+                            SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::EigenDecomposition);
+                            spectralExpansion(epoch->transitionRates, epoch->spectralEigenValues, epoch->spectralEigenVectors, epoch->spectralInverseEigenVectors, &abort);
+                        }, {evalTask});
+                    } else if(method == "Matrix Exponential") {
+                        epochTasks[epoch] = graph.addTask([this, epoch]() {
+                            if(!epoch->changed) return;
+                            SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::MatrixExponentials);
+                            for(double dt : epoch->sampleIntervals)
+                                epoch->propagators.propagator(epoch->transitionRates, dt);
+                        }, {evalTask});
+                    } else {
+                        epochTasks[epoch] = evalTask;
+                    }
+                }
+                for(size_t protocolIndex = 0; protocolIndex < protocols.size(); ++protocolIndex) {
+                    StimulusClampProtocol *protocol = protocols.at(protocolIndex);
+                    std::vector<TaskGraph::TaskId> simulationTasks;
+                    bool startEquilibrated = protocol->startEquilibrated();
+                    // Decide whether the protocol's waveforms and summaries need to be re-evaluated once the unique epochs are known.
+                    // !!! Simulation up to date flags are read here as the simulation tasks may modify them concurrently.
+                    bool isUpToDate = !stochastic;
+                    for(const std::vector<Simulation> &simulationsRow : protocol->simulations) {
+                        for(const Simulation &sim : simulationsRow)
+                            isUpToDate = isUpToDate && sim.isUpToDate.at(variableSetIndex);
+                    }
+                    char *changed = &protocolChanged.at(variableSetIndex).at(protocolIndex);
+                    TaskGraph::TaskId changedTask = graph.addTask([protocol, variableSetIndex, isUpToDate, changed, evaluator]() {
+                        MarkovModel::MarkovModel::ParameterMap parameters;
+                        for(const QString &name : protocol->waveformExprSymbols) {
+                            auto it = evaluator->parameters.find(name);
+                            if(it != evaluator->parameters.end())
+                                parameters[name] = it->second;
+                        }
+                        bool isChanged = !isUpToDate || parameters != protocol->waveformParameters.at(variableSetIndex);
+                        for(size_t row = 0; !isChanged && row < protocol->simulations.size(); ++row) {
+                            for(size_t col = 0; !isChanged && col < protocol->simulations[row].size(); ++col)
+                                isChanged = hasChangedEpochs(protocol->simulations[row][col], variableSetIndex);
+                        }
+                        *changed = isChanged;
+                        protocol->waveformParameters.at(variableSetIndex) = parameters;
+                    }, {evalTask});
+                    for(size_t row = 0; row < protocol->simulations.size(); ++row) {
+                        for(size_t col = 0; col < protocol->simulations[row].size(); ++col) {
+                            Simulation *sim = &protocol->simulations[row][col];
+                            std::vector<TaskGraph::TaskId> dependencies;
+                            for(const Epoch &epoch : sim->epochs)
+                                dependencies.push_back(epochTasks.at(epoch.uniqueEpochs[variableSetIndex]));
+                            std::sort(dependencies.begin(), dependencies.end());
+                            dependencies.erase(std::unique(dependencies.begin(), dependencies.end()), dependencies.end());
+                            // !!! Starting probabilities are only valid once the unique epochs have been evaluated.
+                            const Epoch *firstEpoch = sim->epochs.begin()->uniqueEpochs[variableSetIndex];
+                            std::function<void()> func;
+                            if(method == "Eigen Solver")
+                                func = [=]() { sim->spectralSimulation(firstEpoch->stateProbabilities, startEquilibrated, variableSetIndex, &abort, &message); };
+                            else if(method == "Matrix Exponential")
+                                func = [=]() { sim->matrixExponentialSimulation(firstEpoch->stateProbabilities, startEquilibrated, variableSetIndex, &abort, &message); };
+                            else if(method == "Krylov Subspace")
+                                func = [=]() { sim->krylovSubspaceSimulation(firstEpoch->stateProbabilities, startEquilibrated, variableSetIndex, &abort, &message); };
+                            else if(method == "Monte Carlo")
+                                func = [=]() { sim->monteCarloSimulation(firstEpoch->stateProbabilities, sim->randomSeeds.at(variableSetIndex), numRuns, accumulateRuns, sampleRuns, startEquilibrated, numEventChainsToKeep, variableSetIndex, &abort, &message); };
+                            else if(method == "Stochastic Ensemble")
+                                func = [=]() { sim->stochasticEnsembleSimulation(firstEpoch->stateProbabilities, sim->randomSeeds.at(variableSetIndex), numChannels, startEquilibrated, variableSetIndex, &abort, &message); };
+                            if(func) {
+                                bool isSimulated = !stochastic && sim->isUpToDate.at(variableSetIndex);
+                                dependencies = {graph.addTask([=]() {
+                                    if(isSimulated && !hasChangedEpochs(*sim, variableSetIndex))
+                                        return;
+                                    SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::CellSimulation);
+                                    sim->isUpToDate.at(variableSetIndex) = false;
+                                    // Only Monte Carlo runs are accumulated on top of previous runs.
+                                    if(method != "Monte Carlo")
+                                        sim->numMonteCarloRuns.at(variableSetIndex) = 0;
+                                    // Lumped states are simulated, and their probability is evenly divided among their member states
+                                    // afterwards (plots, state groups and waveforms all refer to the full states).
+                                    Eigen::MatrixXd &P = sim->probability.at(variableSetIndex);
+                                    if(lumping && P.cols() == lumping->numStates())
+                                        P = Eigen::MatrixXd(P * lumping->lumpingMatrix); // e.g. Accumulated Monte Carlo runs.
+                                    func();
+                                    if(lumping && P.cols() == lumping->numLumpedStates())
+                                        P = Eigen::MatrixXd(P * lumping->unlumpingMatrix);
+                                    sim->isUpToDate.at(variableSetIndex) = !abort;
+                                }, dependencies)};
                             }
-                            // Summaries.
-                            foreach(SimulationsSummary *summary, summaries) {
-                                if(abort) break;
-                                if(summary->isActive()) {
-                                    SimulationsSummary::RowMajorMatrixXd &dataX = summary->dataX.at(variableSetIndex);
-                                    SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
-                                    // Limit parser to summary range.
-                                    int firstPt = summary->firstPtX(row, col);
-                                    int numPts = summary->numPtsX(row, col);
-                                    parser.vars().clear();
-                                    for(auto &kv : model->parameters)
-                                        parser.var(kv.first.toStdString()).setLocal(kv.second);
-                                    parser.var("t").setShared(sim.time.data() + firstPt, numPts, 1);
-                                    for(auto &kv : sim.stimuli)
-                                        parser.var(kv.first.toStdString()).setShared(kv.second.data() + firstPt, numPts, 1);
-                                    if(probability) {
-                                        for(int i = 0; i < numStates; ++i)
-                                            parser.var(stateNames.at(i).toStdString()).setShared(probability->col(i).data() + firstPt, numPts, 1);
-                                    }
-                                    for(auto &kv : waveforms)
-                                        parser.var(kv.first.toStdString()).setShared(kv.second.data() + firstPt, numPts, 1);
-                                    // Evaluate summary expression.
-                                    EigenLab::ValueXd result = parser.eval(summary->exprXs[row][col]);
-                                    if(result.matrix().size() != 1)
-                                        throw std::runtime_error("Summary '" + summary->exprXs[row][col] + "' does not reduce to a single value.");
-                                    dataX(row, col) = result.matrix()(0, 0);
-                                    // Limit parser to summary range.
-                                    if(summary->firstPtY(row, col) != firstPt || summary->numPtsY(row, col) != numPts) {
-                                        firstPt = summary->firstPtY(row, col);
-                                        numPts = summary->numPtsY(row, col);
-                                        parser.vars().clear();
-                                        for(auto &kv : model->parameters)
-                                            parser.var(kv.first.toStdString()).setLocal(kv.second);
-                                        parser.var("t").setShared(sim.time.data() + firstPt, numPts, 1);
-                                        for(auto &kv : sim.stimuli)
-                                            parser.var(kv.first.toStdString()).setShared(kv.second.data() + firstPt, numPts, 1);
-                                        if(probability) {
-                                            for(int i = 0; i < numStates; ++i)
-                                                parser.var(stateNames.at(i).toStdString()).setShared(probability->col(i).data() + firstPt, numPts, 1);
-                                        }
-                                        for(auto &kv : waveforms)
-                                            parser.var(kv.first.toStdString()).setShared(kv.second.data() + firstPt, numPts, 1);
-                                    }
-                                    // Evaluate summary expression.
-                                    result = parser.eval(summary->exprYs[row][col]);
-                                    if(result.matrix().size() != 1)
-                                        throw std::runtime_error("Summary '" + summary->exprYs[row][col] + "' does not reduce to a single value.");
-                                    dataY(row, col) = result.matrix()(0, 0);
-                                } // isActive
-                            } // summary
+                            dependencies.push_back(changedTask);
+                            // State groups, waveforms and summaries, and the simulation's cost (so that cost() only has to sum
+                            // the cost of each simulation and the summaries).
+                            simulationTasks.push_back(graph.addTask([=, &stateGroups]() {
+                                if(*changed)
+                                    evalSimulationWaveforms(protocol, row, col, variableSetIndex, method, evaluator->parameters, stateGroups);
+                            }, dependencies));
                         } // col
                     } // row
                     // Summary normalization.
-                    foreach(SimulationsSummary *summary, summaries) {
-                        if(summary->isActive()) {
-                            SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
-                            if(summary->normalization() == SimulationsSummary::PerRow) {
-                                for(int row = 0; row < dataY.rows(); ++row)
-                                    dataY.row(row) /= dataY.row(row).array().abs().maxCoeff();
-                            } else if(summary->normalization() == SimulationsSummary::AllRows) {
-                                dataY /= dataY.array().abs().maxCoeff();
-                            }
+                    graph.addTask([this, protocol, variableSetIndex, changed]() {
+                        if(*changed) {
+                            SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::Summaries);
+                            normalizeSummaries(protocol, variableSetIndex);
                         }
-                    }
+                    }, simulationTasks);
                 } // protocol
             } // variableSetIndex
+            graph.run();
             // Summary reference data.
+            SimulationProfile::ScopedTimer summariesTimer(&profile, SimulationProfile::Summaries);
             for(StimulusClampProtocol *protocol : protocols) {
                 size_t rows = protocol->simulations.size();
                 size_t cols = rows ? protocol->simulations[0].size() : 0;
@@ -1353,22 +2137,206 @@ namespace StimulusClampProtocol
         }
     }
     
-    void StimulusClampProtocolSimulator::optimize(size_t maxIterations, double tolerance, bool showProgressDialog)
+    void StimulusClampProtocolSimulator::evalUniqueEpochs(size_t variableSetIndex, const QString &method, MarkovModel::MarkovModel::Evaluator &evaluator)
     {
-        setRange(0, maxIterations); // Wait progress bar.
-        setValue(0);
-        if(showProgressDialog)
-            show();
-        try {
-            initOptimization();
-            _future = QtConcurrent::run(static_cast<StimulusClampProtocolSimulator*>(this), &StimulusClampProtocolSimulator::runOptimization, maxIterations, tolerance);
-            _watcher.setFuture(_future);
-        } catch(std::runtime_error &e) {
-            message = QString(e.what());
-            _finish();
-        } catch(...) {
-            message = "Undocumentded error.";
-            _finish();
+        // !!! Expressions are evaluated serially with the variable set's evaluator.
+        SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::RateEvaluation);
+        for(Epoch *epoch : uniqueEpochs.at(variableSetIndex)) {
+            if(abort) break;
+            model->evalVariables(epoch->stimuli, variableSetIndex, &evaluator);
+            // Skip epochs whose model expressions evaluate the same as before.
+            std::vector<double> symbolValues;
+            symbolValues.reserve(modelExprSymbols.size());
+            for(const QString &name : modelExprSymbols) {
+                auto it = evaluator.parameters.find(name);
+                if(it != evaluator.parameters.end())
+                    symbolValues.push_back(it->second);
+            }
+            epoch->changed = !epoch->isEvaluated || symbolValues != epoch->symbolValues;
+            if(!epoch->changed)
+                continue;
+            epoch->isEvaluated = false;
+            model->getStateProbabilities(epoch->stateProbabilities, &evaluator);
+            model->getStateAttributes(epoch->stateAttributes, &evaluator);
+            model->getTransitionRates(epoch->transitionRates, &evaluator);
+            model->getTransitionCharges(epoch->transitionCharges, &evaluator);
+            int numStates = epoch->transitionRates.cols();
+            if(epoch->transitionCharges.nonZeros())
+                epoch->stateChargeCurrents = (epoch->transitionRates.cwiseProduct(epoch->transitionCharges) * Eigen::VectorXd::Ones(numStates)).transpose() * 6.242e-6; // pA = 6.242e-6 e/s
+            else
+                epoch->stateChargeCurrents = Eigen::RowVectorXd::Zero(numStates);
+            // Simulate lumped states (probability is evenly divided among the member states afterwards).
+            if(stateLumping.isReduced()) {
+                Eigen::RowVectorXd lumpedProbabilities = epoch->stateProbabilities * stateLumping.lumpingMatrix;
+                Eigen::SparseMatrix<double> lumpedRates = stateLumping.unlumpingMatrix * epoch->transitionRates * stateLumping.lumpingMatrix;
+                epoch->stateProbabilities.swap(lumpedProbabilities);
+                epoch->transitionRates.swap(lumpedRates);
+            }
+            epoch->propagators.clear();
+            if(method != "Eigen Solver") {
+                // The spectral expansion is computed by its own task for the Eigen Solver method only.
+                epoch->spectralEigenValues = Eigen::VectorXd::Zero(1);
+                epoch->spectralEigenVectors.resize(0, 0);
+                epoch->spectralInverseEigenVectors.resize(0, 0);
+                if(method == "Monte Carlo" || method == "Stochastic Ensemble")
+                    epoch->jumpTable.build(epoch->transitionRates);
+            }
+            epoch->symbolValues.swap(symbolValues);
+            epoch->isEvaluated = true;
+        } // epoch
+    }
+    
+    void StimulusClampProtocolSimulator::evalSimulationWaveforms(StimulusClampProtocol *protocol, size_t row, size_t col, size_t variableSetIndex, const QString &method,
+                                                                 const MarkovModel::MarkovModel::ParameterMap &parameters, const QList<MarkovModel::StateGroup*> &stateGroups)
+    {
+        if(abort) return;
+        QList<SimulationsSummary*> summaries = protocol->findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly);
+        EigenLab::ParserXd parser;
+        Simulation &sim = protocol->simulations[row][col];
+        int numPts = sim.time.size();
+        int numStates = stateNames.size();
+        // Probability ptr.
+        Eigen::MatrixXd *probability = 0;
+        if(sim.probability.size() > variableSetIndex)
+            probability = &sim.probability.at(variableSetIndex);
+        if(probability && (probability->rows() != numPts || probability->cols() != numStates))
+            probability = 0;
+        Eigen::MatrixXd tempProbability;
+        if(!probability && method == "Monte Carlo" && sim.events.size() > variableSetIndex) {
+            SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::EventChainSampling);
+            int numSimulatedStates = sim.epochs.begin()->uniqueEpochs[variableSetIndex]->transitionRates.cols();
+            sim.getProbabilityFromEventChains(tempProbability, numSimulatedStates, sim.events.at(variableSetIndex), &abort, &message);
+            if(numSimulatedStates != numStates)
+                tempProbability = Eigen::MatrixXd(tempProbability * stateLumping.unlumpingMatrix);
+            probability = &tempProbability;
+        }
+        // Waveforms ref.
+        SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::Waveforms);
+        std::map<QString, Eigen::VectorXd> &waveforms = sim.waveforms.at(variableSetIndex);
+        // State attributes.
+        if(probability) {
+            for(Epoch &epoch : sim.epochs) {
+                for(auto &kv : epoch.uniqueEpochs[variableSetIndex]->stateAttributes) {
+                    QString attrName = kv.first;
+                    Eigen::RowVectorXd &stateAttrValues = kv.second;
+                    if(waveforms.find(attrName) == waveforms.end())
+                        waveforms[attrName] = Eigen::VectorXd::Zero(numPts);
+                    waveforms[attrName].segment(epoch.firstPt, epoch.numPts) = probability->block(epoch.firstPt, 0, epoch.numPts, numStates) * stateAttrValues.transpose();
+                }
+            }
+        }
+        // State groups.
+        if(probability) {
+            foreach(MarkovModel::StateGroup *stateGroup, stateGroups) {
+                if(stateGroup->isActive()) {
+                    waveforms[stateGroup->name()] = Eigen::VectorXd::Zero(numPts);
+                    Eigen::VectorXd &waveform = waveforms.at(stateGroup->name());
+                    for(int stateIndex : stateGroup->stateIndexes)
+                        waveform += probability->col(stateIndex);
+                }
+            }
+        }
+        // Parser with only the names referred to by the protocol's expressions (as resolved by StimulusClampProtocol::init).
+        // Each name is bound to a waveform, state probability, stimulus, time or model parameter, in that order of precedence.
+        // Summaries only shift the data pointers to their sample window.
+        const std::vector<StimulusClampProtocol::ExprSymbol> &exprSymbols = protocol->exprSymbols;
+        std::vector<EigenLab::ValueXd*> symbolVars(exprSymbols.size(), 0);
+        std::vector<double*> symbolData(exprSymbols.size(), 0); // Full length arrays (0 for parameters).
+        parser.vars().clear();
+        for(size_t i = 0; i < exprSymbols.size(); ++i) {
+            const StimulusClampProtocol::ExprSymbol &symbol = exprSymbols.at(i);
+            auto waveformIter = waveforms.find(symbol.name);
+            auto stimulusIter = sim.stimuli.find(symbol.name);
+            if(waveformIter != waveforms.end()) {
+                symbolData.at(i) = waveformIter->second.data();
+            } else if(probability && symbol.stateIndex != -1) {
+                symbolData.at(i) = probability->col(symbol.stateIndex).data();
+            } else if(stimulusIter != sim.stimuli.end()) {
+                symbolData.at(i) = stimulusIter->second.data();
+            } else if(symbol.key == "t") {
+                symbolData.at(i) = sim.time.data();
+            } else {
+                auto parameterIter = parameters.find(symbol.name);
+                if(parameterIter != parameters.end()) {
+                    symbolVars.at(i) = &parser.var(symbol.key);
+                    symbolVars.at(i)->setLocal(parameterIter->second);
+                }
+                continue;
+            }
+            symbolVars.at(i) = &parser.var(symbol.key);
+            symbolVars.at(i)->setShared(symbolData.at(i), numPts, 1);
+        }
+        // Waveforms.
+        foreach(Waveform *waveform, protocol->findChildren<Waveform*>(QString(), Qt::FindDirectChildrenOnly)) {
+            if(abort) break;
+            if(waveform->isActive()) {
+                EigenLab::ValueXd result = parser.eval(waveform->parsedExpr);
+                if(result.matrix().rows() != numPts || result.matrix().cols() != 1)
+                    throw std::runtime_error("Invalid dimensions for waveform '" + waveform->parsedExpr + "'.");
+                Eigen::VectorXd &data = waveforms[waveform->name()];
+                data = result.matrix();
+                int i = waveform->exprSymbolIndex;
+                if(i != -1) {
+                    symbolData.at(i) = data.data();
+                    if(!symbolVars.at(i))
+                        symbolVars.at(i) = &parser.var(exprSymbols.at(i).key);
+                    symbolVars.at(i)->setShared(data.data(), numPts, 1);
+                }
+            }
+        }
+        // Summaries.
+        timer.restart(&profile, SimulationProfile::Summaries);
+        auto bindSummaryWindow = [&](int first, int n) {
+            for(size_t i = 0; i < exprSymbols.size(); ++i) {
+                if(symbolData.at(i))
+                    symbolVars.at(i)->setShared(symbolData.at(i) + first, n, 1);
+            }
+        };
+        foreach(SimulationsSummary *summary, summaries) {
+            if(abort) break;
+            if(summary->isActive()) {
+                SimulationsSummary::RowMajorMatrixXd &dataX = summary->dataX.at(variableSetIndex);
+                SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
+                // Limit parser to summary range.
+                int firstPt = summary->firstPtX(row, col);
+                int numPts = summary->numPtsX(row, col);
+                bindSummaryWindow(firstPt, numPts);
+                // Evaluate summary expression.
+                EigenLab::ValueXd result = parser.eval(summary->exprXs[row][col]);
+                if(result.matrix().size() != 1)
+                    throw std::runtime_error("Summary '" + summary->exprXs[row][col] + "' does not reduce to a single value.");
+                dataX(row, col) = result.matrix()(0, 0);
+                // Limit parser to summary range.
+                if(summary->firstPtY(row, col) != firstPt || summary->numPtsY(row, col) != numPts) {
+                    firstPt = summary->firstPtY(row, col);
+                    numPts = summary->numPtsY(row, col);
+                    bindSummaryWindow(firstPt, numPts);
+                }
+                // Evaluate summary expression.
+                result = parser.eval(summary->exprYs[row][col]);
+                if(result.matrix().size() != 1)
+                    throw std::runtime_error("Summary '" + summary->exprYs[row][col] + "' does not reduce to a single value.");
+                dataY(row, col) = result.matrix()(0, 0);
+            } // isActive
+        } // summary
+        // Cost vs. the same probability the waveforms were computed from (e.g. sampled from Monte Carlo event chains).
+        timer.restart(&profile, SimulationProfile::Cost);
+        sim.costs.at(variableSetIndex) = sim.cost(variableSetIndex, probability);
+    }
+    
+    void StimulusClampProtocolSimulator::normalizeSummaries(StimulusClampProtocol *protocol, size_t variableSetIndex)
+    {
+        if(abort) return;
+        foreach(SimulationsSummary *summary, protocol->findChildren<SimulationsSummary*>(QString(), Qt::FindDirectChildrenOnly)) {
+            if(summary->isActive()) {
+                SimulationsSummary::RowMajorMatrixXd &dataY = summary->dataY.at(variableSetIndex);
+                if(summary->normalization() == SimulationsSummary::PerRow) {
+                    for(int row = 0; row < dataY.rows(); ++row)
+                        dataY.row(row) /= dataY.row(row).array().abs().maxCoeff();
+                } else if(summary->normalization() == SimulationsSummary::AllRows) {
+                    dataY /= dataY.array().abs().maxCoeff();
+                }
+            }
         }
     }
     
@@ -1425,35 +2393,13 @@ namespace StimulusClampProtocol
     
     double StimulusClampProtocolSimulator::cost()
     {
+        SimulationProfile::ScopedTimer timer(&profile, SimulationProfile::Cost);
         double cost = 0;
         for(StimulusClampProtocol *protocol : protocols)
             cost += protocol->cost();
         return cost;
     }
     
-    void StimulusClampProtocolSimulator::_abort()
-    {
-        abort = true;
-        emit aborted();
-        // Redraw dialog with "Aborting..." message.
-        setLabelText("Aborting...");
-        show();
-        QApplication::processEvents();
-    }
-    
-    void StimulusClampProtocolSimulator::_finish()
-    {
-        emit finished();
-        if(!message.isEmpty()) {
-            show();
-            QErrorMessage errMsg(this);
-            errMsg.showMessage(message);
-            errMsg.exec();
-        }
-        close();
-        deleteLater();
-    }
-    
     // Specialization for strings because ranges don't make sense for strings.
     template <>
     std::vector<std::string> str2vec<std::string>(const QString &str, const QString &delimiterRegex, const QString &/* rangeDelimiterRegex */)
@@ -1480,6 +2426,256 @@ namespace StimulusClampProtocol
         
         protocol.dump(std::cout);
         
+        // Philox4x32-10 known answer test (Random123).
+        uint32_t counter[4] = {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344};
+        uint32_t key[2] = {0xa4093822, 0x299f31d0};
+        uint32_t output[4];
+        Philox4x32::bijection(counter, key, output);
+        VERIFY(output[0] == 0xd16cfe09 && output[1] == 0x94fdcceb && output[2] == 0x5001e420 && output[3] == 0x24126ea1, "Philox4x32::bijection failed known answer test.");
+        Philox4x32 rng1(42, 7), rng2(42, 7), rng3(42, 8);
+        bool sameStream = true, sameAsOtherStream = true;
+        for(int i = 0; i < 10; ++i) {
+            uint32_t x = rng1();
+            if(x != rng2()) sameStream = false;
+            if(x != rng3()) sameAsOtherStream = false;
+        }
+        VERIFY(sameStream && !sameAsOtherStream, "Philox4x32 streams are not reproducible or not independent.");
+        VERIFY(splitMix64(0) == 0xE220A8397B1DCDAFULL, "splitMix64 failed known answer test.");
+        VERIFY(deriveSeed(42, 1) != deriveSeed(42, 2) && deriveSeed(42, 1) != deriveSeed(43, 1), "deriveSeed substreams are not distinct.");
+        
+        // Binomial random numbers by inversion (small n * p) and by transformed rejection (large n * p).
+        for(double p : {0.005, 0.3, 0.9}) {
+            Philox4x32 rng(42);
+            const long long n = 1000;
+            const int numDraws = 100000;
+            double sum = 0, sumOfSquares = 0;
+            for(int i = 0; i < numDraws; ++i) {
+                double k = randomBinomial(rng, n, p);
+                sum += k;
+                sumOfSquares += k * k;
+            }
+            double mean = sum / numDraws;
+            double variance = sumOfSquares / numDraws - mean * mean;
+            double expectedVariance = n * p * (1 - p);
+            VERIFY(fabs(mean - n * p) < 5 * sqrt(expectedVariance / numDraws) && fabs(variance / expectedVariance - 1) < 0.05, "randomBinomial mean or variance is off for p = " << p << ".");
+        }
+        
+        // Event chains for models with more states than fit in 16 bit indexes.
+        MonteCarloEventChains wideChains(MonteCarloEventChains::maxNumNarrowStates + 1), mergedChains(MonteCarloEventChains::maxNumNarrowStates + 1);
+        wideChains.push_back(MonteCarloEvent(MonteCarloEventChains::maxNumNarrowStates, 0.5));
+        wideChains.push_back(MonteCarloEvent(1, 0.5));
+        wideChains.endChain();
+        mergedChains.append(wideChains);
+        VERIFY(mergedChains.isWide() && mergedChains.size() == 1 && mergedChains.at(0).state(0) == MonteCarloEventChains::maxNumNarrowStates && mergedChains.at(0).state(1) == 1, "Wide Monte Carlo event chain states were truncated.");
+        
+        // Accumulated Monte Carlo runs, with and without sampling probability during the runs.
+        for(bool sampleRuns : {true, false}) {
+            Eigen::MatrixXd Q(2, 2);
+            Q << -1, 1, 2, -2;
+            Epoch uniqueEpoch;
+            uniqueEpoch.transitionRates = Q.sparseView();
+            uniqueEpoch.jumpTable.build(uniqueEpoch.transitionRates);
+            Epoch epoch(0);
+            epoch.duration = 1;
+            epoch.uniqueEpochs.push_back(&uniqueEpoch);
+            Simulation sim;
+            sim.time = Eigen::VectorXd::LinSpaced(11, 0, 1);
+            sim.endTime = 1;
+            sim.sampleInterval = 0.1;
+            sim.epochs.push_back(epoch);
+            Eigen::RowVectorXd startingProbability(2);
+            startingProbability << 1, 0;
+            uint64_t seed = 42;
+            sim.monteCarloSimulation(startingProbability, seed, 100, true, sampleRuns);
+            sim.monteCarloSimulation(startingProbability, seed, 100, true, sampleRuns);
+            VERIFY(sim.numMonteCarloRuns.at(0) == 200 && sim.events.at(0).size() == 200, "Accumulated Monte Carlo runs were dropped (sampleRuns = " << sampleRuns << ").");
+            if(sampleRuns) {
+                Eigen::MatrixXd P;
+                sim.getProbabilityFromEventChains(P, 2, sim.events.at(0));
+                VERIFY((sim.probability.at(0) - P).cwiseAbs().maxCoeff() < 1e-9, "Accumulated Monte Carlo probability does not average all runs.");
+            } else {
+                VERIFY(sim.probability.at(0).size() == 0, "Unsampled Monte Carlo probability was not cleared.");
+            }
+        }
+        
+        // Cost of state referenced data vs. Monte Carlo probability sampled during the runs or afterwards from the kept event chains.
+        {
+            Eigen::MatrixXd Q(2, 2);
+            Q << -1, 1, 2, -2;
+            Epoch uniqueEpoch;
+            uniqueEpoch.transitionRates = Q.sparseView();
+            uniqueEpoch.jumpTable.build(uniqueEpoch.transitionRates);
+            Epoch epoch(0);
+            epoch.duration = 1;
+            epoch.firstPt = 0;
+            epoch.numPts = 11;
+            epoch.uniqueEpochs.push_back(&uniqueEpoch);
+            Simulation sim;
+            sim.time = Eigen::VectorXd::LinSpaced(11, 0, 1);
+            sim.endTime = 1;
+            sim.sampleInterval = 0.1;
+            sim.epochs.push_back(epoch);
+            sim.weight = Eigen::VectorXd::Ones(11);
+            Simulation::RefData refData;
+            refData.waveform = Eigen::VectorXd::Constant(11, 0.5);
+            refData.firstPt = 0;
+            refData.numPts = 11;
+            refData.weight = 1;
+            refData.stateIndex = 1;
+            sim.referenceData.resize(1);
+            sim.referenceData.at(0)["C2"] = refData;
+            Simulation sampledSim = sim, unsampledSim = sim;
+            Eigen::RowVectorXd startingProbability(2);
+            startingProbability << 1, 0;
+            uint64_t sampledSeed = 42, unsampledSeed = 42;
+            sampledSim.monteCarloSimulation(startingProbability, sampledSeed, 100, false, true);
+            unsampledSim.monteCarloSimulation(startingProbability, unsampledSeed, 100, false, false);
+            Eigen::MatrixXd P;
+            unsampledSim.getProbabilityFromEventChains(P, 2, unsampledSim.events.at(0));
+            double sampledCost = sampledSim.cost(0);
+            double unsampledCost = unsampledSim.cost(0, &P);
+            VERIFY(sampledCost > 0 && fabs(sampledCost - unsampledCost) < 1e-9 * sampledCost, "Cost differs for Monte Carlo probability sampled during or after the runs.");
+        }
+        
+        // Stochastic ensemble mean vs. the probability from the matrix exponential, for many small ensembles simulated
+        // with Gillespie steps and for a single large ensemble simulated with multinomial leaps.
+        {
+            std::vector<Eigen::MatrixXd> Q(2, Eigen::MatrixXd(3, 3));
+            Q[0] << -2, 2, 0, 1, -4, 3, 0, 5, -5;
+            Q[1] << -0.5, 0.5, 0, 4, -5, 1, 0, 3, -3;
+            std::vector<Epoch> uniqueEpochs(2);
+            Simulation sim;
+            sim.time = Eigen::VectorXd::LinSpaced(21, 0, 2);
+            sim.endTime = 2;
+            sim.sampleInterval = 0.1;
+            for(int i = 0; i < 2; ++i) {
+                Epoch &uniqueEpoch = uniqueEpochs.at(i);
+                uniqueEpoch.transitionRates = Q[i].sparseView();
+                uniqueEpoch.jumpTable.build(uniqueEpoch.transitionRates);
+                Epoch epoch(i);
+                epoch.duration = 1;
+                epoch.firstPt = 10 * i;
+                epoch.numPts = i == 0 ? 10 : 11;
+                epoch.uniqueEpochs.push_back(&uniqueEpoch);
+                sim.epochs.push_back(epoch);
+            }
+            Eigen::RowVectorXd startingProbability(3);
+            startingProbability << 1, 0, 0;
+            sim.matrixExponentialSimulation(startingProbability);
+            Eigen::MatrixXd P = sim.probability.at(0);
+            uint64_t seed = 42;
+            const int numEnsembles = 20000;
+            Eigen::MatrixXd meanP = Eigen::MatrixXd::Zero(P.rows(), P.cols());
+            for(int i = 0; i < numEnsembles; ++i) {
+                sim.stochasticEnsembleSimulation(startingProbability, seed, 10);
+                meanP += sim.probability.at(0) / numEnsembles;
+            }
+            VERIFY((meanP - P).cwiseAbs().maxCoeff() < 0.01, "Mean of small stochastic ensembles differs from the state probability.");
+            sim.stochasticEnsembleSimulation(startingProbability, seed, 1000000);
+            VERIFY((sim.probability.at(0) - P).cwiseAbs().maxCoeff() < 0.01, "Large stochastic ensemble differs from the state probability.");
+        }
+        
+        // Krylov subspace approximation vs. the Pade approximation of the matrix exponential, for a single interval
+        // and for successive steps that share a workspace (as in krylovSubspaceSimulation).
+        {
+            const int numStates = 60; // More than the Krylov subspace dimension.
+            std::vector<Eigen::Triplet<double> > triplets;
+            for(int i = 0; i + 1 < numStates; ++i) {
+                double forwardRate = 1 + i % 3, backwardRate = 0.5 + i % 5;
+                triplets.push_back(Eigen::Triplet<double>(i, i + 1, forwardRate));
+                triplets.push_back(Eigen::Triplet<double>(i, i, -forwardRate));
+                triplets.push_back(Eigen::Triplet<double>(i + 1, i, backwardRate));
+                triplets.push_back(Eigen::Triplet<double>(i + 1, i + 1, -backwardRate));
+            }
+            Eigen::SparseMatrix<double> Q(numStates, numStates);
+            Q.setFromTriplets(triplets.begin(), triplets.end());
+            Eigen::SparseMatrix<double> QT = Q.transpose();
+            Eigen::VectorXd p0 = Eigen::VectorXd::Zero(numStates);
+            p0[0] = 1;
+            Eigen::VectorXd p = (Eigen::MatrixXd(QT) * 20.0).exp() * p0;
+            Eigen::VectorXd krylovP = krylovExpv(20.0, QT, p0);
+            KrylovWorkspace workspace;
+            Eigen::VectorXd steppedKrylovP = p0;
+            for(int i = 0; i < 200; ++i)
+                steppedKrylovP = krylovExpv(0.1, QT, steppedKrylovP, workspace);
+            VERIFY((krylovP - p).cwiseAbs().maxCoeff() < 1e-6 && (steppedKrylovP - p).cwiseAbs().maxCoeff() < 1e-6, "krylovExpv differs from expm.");
+        }
+        
+        // Krylov subspace, matrix exponential and spectral simulations of a protocol with uneven epochs,
+        // where the first epoch ends between sample points and the second has no sample points at all.
+        {
+            std::vector<Eigen::MatrixXd> Q(3, Eigen::MatrixXd(3, 3));
+            Q[0] << -2, 2, 0, 1, -4, 3, 0, 5, -5;
+            Q[1] << -30, 30, 0, 1, -21, 20, 0, 2, -2;
+            Q[2] << -0.5, 0.5, 0, 4, -5, 1, 0, 3, -3;
+            std::vector<Epoch> uniqueEpochs(3);
+            Simulation sim;
+            sim.time = Eigen::VectorXd::LinSpaced(11, 0, 1);
+            sim.endTime = 1;
+            sim.sampleInterval = 0.1;
+            const double start[3] = {0, 0.25, 0.3};
+            const int firstPt[3] = {0, 3, 3};
+            const int numPts[3] = {3, 0, 8};
+            for(int i = 0; i < 3; ++i) {
+                Epoch &uniqueEpoch = uniqueEpochs.at(i);
+                uniqueEpoch.transitionRates = Q[i].sparseView();
+                spectralExpansion(uniqueEpoch.transitionRates, uniqueEpoch.spectralEigenValues, uniqueEpoch.spectralEigenVectors, uniqueEpoch.spectralInverseEigenVectors);
+                Epoch epoch(start[i]);
+                epoch.duration = (i + 1 < 3 ? start[i + 1] : sim.endTime) - start[i];
+                epoch.firstPt = firstPt[i];
+                epoch.numPts = numPts[i];
+                epoch.uniqueEpochs.push_back(&uniqueEpoch);
+                sim.epochs.push_back(epoch);
+            }
+            Eigen::RowVectorXd startingProbability(3);
+            startingProbability << 1, 0, 0;
+            sim.spectralSimulation(startingProbability);
+            Eigen::MatrixXd spectralP = sim.probability.at(0);
+            sim.matrixExponentialSimulation(startingProbability);
+            Eigen::MatrixXd matrixExponentialP = sim.probability.at(0);
+            sim.krylovSubspaceSimulation(startingProbability);
+            Eigen::MatrixXd krylovP = sim.probability.at(0);
+            VERIFY((matrixExponentialP - spectralP).cwiseAbs().maxCoeff() < 1e-9, "Matrix exponential and spectral simulations of uneven epochs differ.");
+            VERIFY((krylovP - spectralP).cwiseAbs().maxCoeff() < 1e-6, "Krylov subspace and spectral simulations of uneven epochs differ.");
+        }
+        
+        // TaskGraph runs each task after the tasks it depends on, and skips the remaining tasks and rethrows the first error if a task throws.
+        {
+            TaskGraph graph;
+            std::vector<int> finishOrder;
+            QMutex mutex;
+            auto task = [&finishOrder, &mutex](int i) { return [&finishOrder, &mutex, i]() { QMutexLocker locker(&mutex); finishOrder.push_back(i); }; };
+            TaskGraph::TaskId a = graph.addTask(task(0));
+            TaskGraph::TaskId b = graph.addTask(task(1), {a});
+            TaskGraph::TaskId c = graph.addTask(task(2), {a});
+            graph.addTask(task(3), {b, c});
+            TaskGraph::TaskId e = graph.addTask(task(4));
+            graph.addTask(task(5), {e});
+            graph.run();
+            std::vector<int> position(6, -1);
+            for(size_t i = 0; i < finishOrder.size(); ++i)
+                position.at(finishOrder.at(i)) = int(i);
+            VERIFY(finishOrder.size() == 6 && position[0] < position[1] && position[0] < position[2] && position[1] < position[3] && position[2] < position[3] && position[4] < position[5],
+                   "TaskGraph ran a task before the tasks it depends on.");
+        }
+        for(bool isStdException : {true, false}) {
+            TaskGraph graph;
+            std::atomic<bool> dependentRan(false);
+            TaskGraph::TaskId failingTask = graph.addTask([isStdException]() {
+                if(isStdException)
+                    throw std::runtime_error("Task failed.");
+                throw 0;
+            });
+            graph.addTask([&dependentRan]() { dependentRan = true; }, {failingTask});
+            std::string error;
+            try {
+                graph.run();
+            } catch(std::runtime_error &e) {
+                error = e.what();
+            }
+            VERIFY(error == (isStdException ? "Task failed." : "Undocumented error.") && !dependentRan, "TaskGraph did not propagate a task error.");
+        }
+        
         std::cout << "Test completed with " << numErrors << " error(s)." << std::endl;
     }
 #endif
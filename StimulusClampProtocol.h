@@ -10,23 +10,24 @@
 
 #include "MarkovModel.h"
 #include "QObjectPropertyTreeSerializer.h"
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <map>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
 #include <vector>
-#include <QCloseEvent>
 #include <QDir>
 #include <QFileInfo>
-#include <QFuture>
-#include <QFutureWatcher>
+#include <QMutex>
 #include <QObject>
-#include <QProgressDialog>
+#include <QPointer>
 #include <QRegularExpression>
 #include <QString>
-#include <QWidget>
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 #include <gsl/gsl_multimin.h>
@@ -41,19 +42,109 @@ namespace StimulusClampProtocol
     typedef std::atomic<bool> AbortFlag;
     
     /* --------------------------------------------------------------------------------
-     * Get a pre-seeded random number generator.
+     * SplitMix64 finalizer (Steele et al., OOPSLA 2014).
+     * Used to derive seeds for reproducible random number substreams, e.g.
+     * deriveSeed(deriveSeed(seed, row), col) for a simulation in a protocol.
      * -------------------------------------------------------------------------------- */
-    template <typename T = std::mt19937>
-    T getSeededRandomNumberGenerator()
+    inline uint64_t splitMix64(uint64_t x)
+    {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+    
+    inline uint64_t deriveSeed(uint64_t seed, uint64_t id)
+    {
+        return splitMix64(seed ^ splitMix64(id));
+    }
+    
+    // Seed drawn from std::random_device (nondeterministic).
+    inline uint64_t nondeterministicSeed()
     {
         std::random_device rd;
-        std::array<std::random_device::result_type, T::state_size> seed_data;
-        std::generate_n(seed_data.data(), seed_data.size(), std::ref(rd));
-        std::seed_seq seq(std::begin(seed_data), std::end(seed_data));
-        T rng(seq);
-        return rng;
+        return (uint64_t(rd()) << 32) | uint64_t(rd());
     }
     
+    /* --------------------------------------------------------------------------------
+     * Philox4x32-10 counter-based random number generator (Salmon et al., SC11, 2011).
+     * Each (key, stream) pair is an independent reproducible stream, so that e.g. Monte Carlo
+     * runs can be distributed across threads without changing the results.
+     * Satisfies the UniformRandomBitGenerator requirements (32-bit output).
+     * -------------------------------------------------------------------------------- */
+    class Philox4x32
+    {
+    public:
+        typedef uint32_t result_type;
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return 0xFFFFFFFF; }
+        
+        Philox4x32(uint64_t key = 0, uint64_t stream = 0) : _index(4)
+        {
+            _key[0] = uint32_t(key);
+            _key[1] = uint32_t(key >> 32);
+            _counter[0] = 0;
+            _counter[1] = 0;
+            _counter[2] = uint32_t(stream);
+            _counter[3] = uint32_t(stream >> 32);
+        }
+        
+        result_type operator()()
+        {
+            if(_index == 4) {
+                generateBlock();
+                _index = 0;
+            }
+            return _output[_index++];
+        }
+        
+        // Uniform random number in [0, 1) with 53 bit resolution.
+        double uniform()
+        {
+            uint64_t a = (*this)() >> 5;
+            uint64_t b = (*this)() >> 6;
+            return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+        }
+        
+        // Philox4x32-10 bijection of a single counter block (exposed for testing).
+        static void bijection(const uint32_t counter[4], const uint32_t key[2], uint32_t output[4])
+        {
+            uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+            uint32_t k0 = key[0], k1 = key[1];
+            for(int round = 0; round < 10; ++round) {
+                if(round > 0) {
+                    k0 += 0x9E3779B9;
+                    k1 += 0xBB67AE85;
+                }
+                uint64_t p0 = uint64_t(0xD2511F53) * c0;
+                uint64_t p1 = uint64_t(0xCD9E8D57) * c2;
+                uint32_t hi0 = uint32_t(p0 >> 32), lo0 = uint32_t(p0);
+                uint32_t hi1 = uint32_t(p1 >> 32), lo1 = uint32_t(p1);
+                c0 = hi1 ^ c1 ^ k0;
+                c1 = lo1;
+                c2 = hi0 ^ c3 ^ k1;
+                c3 = lo0;
+            }
+            output[0] = c0;
+            output[1] = c1;
+            output[2] = c2;
+            output[3] = c3;
+        }
+        
+    protected:
+        uint32_t _key[2];
+        uint32_t _counter[4]; // [0, 1] = block index, [2, 3] = stream.
+        uint32_t _output[4];
+        int _index;
+        
+        void generateBlock()
+        {
+            bijection(_counter, _key, _output);
+            if(++_counter[0] == 0)
+                ++_counter[1];
+        }
+    };
+    
     /* --------------------------------------------------------------------------------
      * Info for a Monte Carlo event.
      * -------------------------------------------------------------------------------- */
@@ -64,20 +155,201 @@ namespace StimulusClampProtocol
         
         MonteCarloEvent(int state = -1, double duration = 0) : state(state), duration(duration) {}
     };
-    typedef std::vector<MonteCarloEvent> MonteCarloEventChain;
+    
+    /* --------------------------------------------------------------------------------
+     * Compact storage for Monte Carlo event chains.
+     * All chains are held in one contiguous arena with an offset index. States are stored
+     * as 16 bit indexes and durations (dwell times) as floats, i.e. 6 bytes per event.
+     * Models with more than 65536 states are stored with 32 bit state indexes instead
+     * (8 bytes per event). The width is selected by the number of states.
+     * Events are appended to an open chain which is closed with endChain().
+     * Also records the number of states the chains were simulated for, so that chains
+     * are not accumulated across models with different (e.g. lumped) states.
+     * -------------------------------------------------------------------------------- */
+    class MonteCarloEventChains
+    {
+    public:
+        static const int maxNumNarrowStates = 65536; // Max # of states stored as 16 bit indexes.
+        
+        // Read only view of a single chain.
+        class Chain
+        {
+        public:
+            Chain() : _states(0), _wideStates(0), _durations(0), _size(0) {}
+            size_t size() const { return _size; }
+            bool empty() const { return _size == 0; }
+            int state(size_t i) const { return _wideStates ? int(_wideStates[i]) : int(_states[i]); }
+            double duration(size_t i) const { return _durations[i]; }
+            MonteCarloEvent operator[](size_t i) const { return MonteCarloEvent(state(i), _durations[i]); }
+            
+        private:
+            friend class MonteCarloEventChains;
+            const uint16_t *_states;
+            const uint32_t *_wideStates; // Only for wide chains.
+            const float *_durations;
+            size_t _size;
+        };
+        
+        MonteCarloEventChains(int numStates = 0) : _offsets(1, 0), _numStates(numStates) {}
+        
+        int numStates() const { return _numStates; }
+        bool isWide() const { return _numStates > maxNumNarrowStates; }
+        
+        // Number of closed chains.
+        size_t size() const { return _offsets.size() - 1; }
+        bool empty() const { return size() == 0; }
+        size_t numEvents() const { return _durations.size(); }
+        
+        Chain at(size_t i) const
+        {
+            size_t first = _offsets.at(i);
+            Chain chain;
+            chain._size = _offsets.at(i + 1) - first;
+            if(isWide())
+                chain._wideStates = _wideStates.data() + first;
+            else
+                chain._states = _states.data() + first;
+            chain._durations = _durations.data() + first;
+            return chain;
+        }
+        
+        void push_back(const MonteCarloEvent &event)
+        {
+            if(isWide())
+                _wideStates.push_back(uint32_t(event.state));
+            else
+                _states.push_back(uint16_t(event.state));
+            _durations.push_back(float(event.duration));
+        }
+        void endChain() { _offsets.push_back(_durations.size()); }
+        void discardOpenChain();
+        
+        void clear();
+        void clear(int numStates) { clear(); _numStates = numStates; }
+        void truncate(size_t numChains);
+        void append(const MonteCarloEventChains &chains);
+        
+    private:
+        std::vector<size_t> _offsets; // Events for chain i are [_offsets[i], _offsets[i + 1]).
+        std::vector<uint16_t> _states;
+        std::vector<uint32_t> _wideStates; // Used instead of _states if isWide().
+        std::vector<float> _durations;
+        int _numStates;
+    };
     
     /* --------------------------------------------------------------------------------
      * Equilibrium state probabilities from transition rates Q matrix.
+     * Solves p * Q = 0 with sum(p) = 1 using a sparse LU factorization, falling back to
+     * a sparse least squares solution if the chain has no unique equilibrium.
      * !!! Note that if you have the spectral expansion, then the equilibrium state probabilities
-     *     are just the initial state probabilities multiplied by the spectral matrix with zero eigenvalue.
+     *     are just the initial state probabilities projected onto the eigenvector with zero eigenvalue.
      * -------------------------------------------------------------------------------- */
-    Eigen::RowVectorXd equilibriumProbability(const Eigen::MatrixXd &Q);
+    Eigen::RowVectorXd equilibriumProbability(const Eigen::SparseMatrix<double> &Q);
     
     /* --------------------------------------------------------------------------------
      * Spectral expansion of unitary transition rates Q matrix.
-     * !!! This will invalidate the input matrix Q.
+     * Q = V * diag(eigenValues) * V^-1 with eigenvalues sorted by ascending absolute value,
+     * so the i-th spectral matrix is the rank one product V.col(i) * V^-1.row(i).
+     * -------------------------------------------------------------------------------- */
+    void spectralExpansion(const Eigen::SparseMatrix<double> &Q, Eigen::VectorXd &eigenValues, Eigen::MatrixXd &eigenVectors, Eigen::MatrixXd &inverseEigenVectors, AbortFlag *abort = 0);
+    
+    /* --------------------------------------------------------------------------------
+     * Memoized matrix exponentials expm(Q * t) of a transition rates Q matrix keyed by time interval t.
+     * Uses scaling and squaring with Pade approximation (Higham, 2005).
+     * Lookups are thread safe and missing propagators are computed on demand.
+     * Intervals equal to within a relative tolerance share the same propagator.
+     * Copies start out empty.
+     * Used by the matrix exponential and stochastic ensemble methods only. The spectral
+     * method already shares its eigendecomposition across simulations of a unique epoch
+     * and needs only exp(eigenvalue * t) per sample, and the Krylov method exists to
+     * avoid forming dense n x n propagators for large models.
+     * !!! Must be cleared whenever Q changes.
+     * -------------------------------------------------------------------------------- */
+    class PropagatorCache
+    {
+    public:
+        PropagatorCache() {}
+        PropagatorCache(const PropagatorCache &) {}
+        PropagatorCache& operator=(const PropagatorCache &) { clear(); return *this; }
+        
+        void clear();
+        const Eigen::MatrixXd& propagator(const Eigen::SparseMatrix<double> &Q, double t);
+        
+    private:
+        std::map<double, Eigen::MatrixXd> _propagators;
+        QMutex _mutex;
+        
+        std::map<double, Eigen::MatrixXd>::const_iterator find(double t) const;
+    };
+    
+    /* --------------------------------------------------------------------------------
+     * Monte Carlo jump table for a transition rates Q matrix.
+     * Exit rate of each state and a Walker alias table of its destination states,
+     * so that selecting the next state takes a single uniform random number in O(1).
+     * -------------------------------------------------------------------------------- */
+    class MonteCarloJumpTable
+    {
+    public:
+        void build(const Eigen::SparseMatrix<double> &Q);
+        void clear();
+        
+        // Net rate leaving state.
+        double exitRate(int state) const { return _exitRates[state]; }
+        
+        // Select next state given a uniform random number u in [0, 1).
+        int nextState(int state, double u) const
+        {
+            int first = _offsets[state];
+            int numDestinations = _offsets[state + 1] - first;
+            if(numDestinations == 0)
+                return state;
+            double x = u * numDestinations;
+            int k = std::min(int(x), numDestinations - 1);
+            const AliasEntry &entry = _entries[first + k];
+            return x - k < entry.probability ? entry.state : entry.alias;
+        }
+        
+    private:
+        struct AliasEntry
+        {
+            double probability; // Probability of keeping state rather than alias.
+            int state;
+            int alias;
+        };
+        std::vector<double> _exitRates;
+        std::vector<int> _offsets; // Entries for state i are [_offsets[i], _offsets[i + 1]).
+        std::vector<AliasEntry> _entries;
+    };
+    
+    /* --------------------------------------------------------------------------------
+     * Workspace for repeated krylovExpv() calls with the same A, e.g. stepping from one
+     * sample point to the next. Holds the Arnoldi basis and Hessenberg matrices so they
+     * are only allocated once, the norm of A, and the adaptive step size suggested by the
+     * last step so that the next call continues with it rather than starting over.
+     * !!! Must be reset whenever A changes.
      * -------------------------------------------------------------------------------- */
-    void spectralExpansion(const Eigen::SparseMatrix<double> &Q, Eigen::VectorXd &eigenValues, std::vector<Eigen::MatrixXd> &spectralMatrices, AbortFlag *abort = 0);
+    struct KrylovWorkspace
+    {
+        Eigen::MatrixXd V; // Arnoldi basis.
+        Eigen::MatrixXd H; // Upper Hessenberg matrix (augmented for the error estimate).
+        Eigen::MatrixXd F; // expm of H.
+        Eigen::VectorXd p;
+        double anorm; // Infinity norm of A (negative until computed).
+        double tnew; // Next step size (zero until the first step).
+        
+        KrylovWorkspace() : anorm(-1), tnew(0) {}
+        void reset() { anorm = -1; tnew = 0; }
+    };
+    
+    /* --------------------------------------------------------------------------------
+     * Krylov subspace approximation of w = expm(t * A) * v for sparse A.
+     * Arnoldi process with m basis vectors and adaptive time steps (Sidje, Expokit, 1998).
+     * Only ever allocates n x (m + 1) and (m + 2) x (m + 2) dense matrices, which are
+     * reused across calls that share a workspace.
+     * !!! For state probabilities p(t) = p(0) * expm(Q * t), pass A = Q^T.
+     * -------------------------------------------------------------------------------- */
+    Eigen::VectorXd krylovExpv(double t, const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &v, KrylovWorkspace &workspace, int m = 30, double tolerance = 1e-7);
+    Eigen::VectorXd krylovExpv(double t, const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &v, int m = 30, double tolerance = 1e-7);
     
     /* --------------------------------------------------------------------------------
      * Find sample indexes in range.
@@ -173,24 +445,39 @@ namespace StimulusClampProtocol
         int firstPt;
         int numPts;
         
-        // Ref to a unique epoch that will have all the data associated with this epoch.
-        Epoch *uniqueEpoch;
+        // Refs to the unique epochs that will have all the data associated with this epoch (one for each variable set).
+        std::vector<Epoch*> uniqueEpochs;
         
         // Data to be computed for unique epochs only.
+        // !!! When equivalent states are lumped (see StimulusClampProtocolSimulator::stateLumping), stateProbabilities
+        //     and transitionRates (and the spectral expansion, propagators and jump table below) are for the lumped states.
         Eigen::RowVectorXd stateProbabilities;
         std::map<QString, Eigen::RowVectorXd> stateAttributes;
         Eigen::SparseMatrix<double> transitionRates; // _ij = rate i->j, _ii = negative sum of rates leaving state i.
         Eigen::SparseMatrix<double> transitionCharges; // _ij = charge moved during transition i->j.
         Eigen::RowVectorXd stateChargeCurrents;
         
-        // Spectral expansion of transitionRates matrix.
+        // Spectral expansion of transitionRates matrix (eigenvalues, eigenvectors as columns and their inverse).
         Eigen::VectorXd spectralEigenValues;
-        std::vector<Eigen::MatrixXd> spectralMatrices;
+        Eigen::MatrixXd spectralEigenVectors;
+        Eigen::MatrixXd spectralInverseEigenVectors;
+        
+        // Sample intervals of all simulations stepping through this unique epoch.
+        std::set<double> sampleIntervals;
+        
+        // Propagators expm(Q * t) shared by all simulations (across protocols) of this unique epoch.
+        PropagatorCache propagators;
         
-        // For exponentially distributed random state lifetimes.
-        std::vector<std::exponential_distribution<double> > randomStateLifetimes;
+        // Monte Carlo exit rates and next state selection.
+        MonteCarloJumpTable jumpTable;
         
-        Epoch(double start = 0) : start(start), duration(0), firstPt(-1), numPts(0), uniqueEpoch(0) {}
+        // Values of the model's expression symbols that the data above was computed from.
+        // The data is only recomputed when these change (e.g. when only some variables are optimized).
+        std::vector<double> symbolValues;
+        bool isEvaluated;
+        bool changed; // Whether the data above changed during the last evaluation.
+        
+        Epoch(double start = 0) : start(start), duration(0), firstPt(-1), numPts(0), isEvaluated(false), changed(true) {}
         
         // For sorting epochs based on start time.
         bool operator < (const Epoch &epoch) const { return start < epoch.start; }
@@ -202,6 +489,7 @@ namespace StimulusClampProtocol
     {
         Eigen::VectorXd time;
         double endTime;
+        double sampleInterval;
         std::map<QString, Eigen::VectorXd> stimuli;
         std::vector<Epoch> epochs;
         Eigen::VectorXd weight;
@@ -210,7 +498,10 @@ namespace StimulusClampProtocol
         // List of simulations for each variable set.
         std::vector<Eigen::MatrixXd> probability; // Columns are time-dependent probability in each state.
         std::vector<std::map<QString, Eigen::VectorXd> > waveforms;
-        std::vector<std::vector<MonteCarloEventChain> > events;
+        std::vector<MonteCarloEventChains> events; // May be a subset of all Monte Carlo runs. States are lumped states if lumping.
+        std::vector<size_t> numMonteCarloRuns; // Number of accumulated Monte Carlo runs (averaged into probability if sampled).
+        std::vector<char> isUpToDate; // Whether probability is up to date with the unique epochs.
+        std::vector<double> costs; // Weighted sum of squared errors vs. reference data, computed along with the waveforms.
         
         // Reference data for each variable set.
         struct RefData
@@ -219,17 +510,27 @@ namespace StimulusClampProtocol
             int firstPt;
             int numPts;
             double weight;
+            int stateIndex; // Referenced state or -1 for a stimulus or waveform (resolved once by StimulusClampProtocol::init).
         };
         std::vector<std::map<QString, RefData> > referenceData;
         
-        // Random number generator.
-        std::mt19937 randomNumberGenerator;
+        // Random number substream seed for each variable set.
+        // Advanced after each Monte Carlo or stochastic ensemble simulation so that repeated or accumulated simulations differ.
+        std::vector<uint64_t> randomSeeds;
+        
+        Simulation() : endTime(0), sampleInterval(0) {}
         
         void findEpochsDiscretizedToSamplePoints();
         void spectralSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated = false, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
-        void monteCarloSimulation(Eigen::RowVectorXd startingProbability, std::mt19937 &randomNumberGenerator, size_t numRuns, bool accumulateRuns = false, bool sampleRuns = true, bool startEquilibrated = false, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
-        void getProbabilityFromEventChains(Eigen::MatrixXd &P, size_t numStates, const std::vector<MonteCarloEventChain> &eventChains, AbortFlag *abort = 0, QString *message = 0);
+        void matrixExponentialSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated = false, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
+        void krylovSubspaceSimulation(Eigen::RowVectorXd startingProbability, bool startEquilibrated = false, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
+        void monteCarloSimulation(Eigen::RowVectorXd startingProbability, uint64_t &seed, size_t numRuns, bool accumulateRuns = false, bool sampleRuns = true, bool startEquilibrated = false, int numEventChainsToKeep = -1, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
+        void stochasticEnsembleSimulation(Eigen::RowVectorXd startingProbability, uint64_t &seed, size_t numChannels, bool startEquilibrated = false, size_t variableSetIndex = 0, AbortFlag *abort = 0, QString *message = 0);
+        void simulateMonteCarloEventChain(MonteCarloEventChains &eventChains, const Eigen::RowVectorXd &startingProbability, Philox4x32 &rng, size_t variableSetIndex = 0, AbortFlag *abort = 0);
+        void getProbabilityFromEventChains(Eigen::MatrixXd &P, size_t numStates, const MonteCarloEventChains &eventChains, AbortFlag *abort = 0, QString *message = 0);
+        void accumulateEventChainOccupancy(Eigen::MatrixXd &P, const MonteCarloEventChains::Chain &eventChain);
         double maxProbabilityError();
+        double cost(size_t variableSetIndex, const Eigen::MatrixXd *probability = 0) const; // Defaults to this simulation's probability.
     };
     
     /* --------------------------------------------------------------------------------
@@ -244,7 +545,7 @@ namespace StimulusClampProtocol
     public:
         // Default constructor.
         Waveform(QObject *parent = 0, const QString &name = "") :
-        QObject(parent), _isActive(true) { setName(name); }
+        QObject(parent), exprSymbolIndex(-1), _isActive(true) { setName(name); }
         
         // Property getters.
         QString name() const { return objectName(); }
@@ -256,6 +557,10 @@ namespace StimulusClampProtocol
         void setIsActive(bool b) { _isActive = b; }
         void setExpr(QString s) { _expr = s; }
         
+        // Set by StimulusClampProtocol::init().
+        std::string parsedExpr;
+        int exprSymbolIndex; // Index of this waveform's name in StimulusClampProtocol::exprSymbols (-1 if not referred to).
+        
     protected:
         // Properties.
         bool _isActive;
@@ -466,8 +771,26 @@ namespace StimulusClampProtocol
         std::vector<std::vector<double> > sampleIntervals;
         std::vector<std::vector<double> > weights;
         
+        // Names referred to by waveform and summary expressions, and their values for each variable set
+        // when the waveforms and summaries were last evaluated (to skip evaluation when nothing changed).
+        std::set<QString> waveformExprSymbols;
+        std::vector<MarkovModel::MarkovModel::ParameterMap> waveformParameters;
+        
+        // The names above resolved once by init(), so that evaluating the expressions for each simulation
+        // (and summary window) only binds these names to their data.
+        struct ExprSymbol
+        {
+            QString name;
+            std::string key; // Parser variable name.
+            int stateIndex; // -1 if not a state.
+        };
+        std::vector<ExprSymbol> exprSymbols; // Same order as waveformExprSymbols.
+        
         // Initialize prior to running a simulation.
-        void init(std::vector<Epoch*> &uniqueEpochs, const QStringList &stateNames);
+        // Input uniqueEpochs should have one (possibly empty) list of unique epochs for each variable set.
+        // Simulation random number seeds are derived from randomSeed and (row, col, variable set) whenever randomSeed
+        // or model changes. Otherwise they keep advancing, so that repeated or accumulated stochastic simulations differ.
+        void init(std::vector<std::vector<Epoch*> > &uniqueEpochs, const QStringList &stateNames, uint64_t randomSeed = 0, MarkovModel::MarkovModel *model = 0);
         
         // Cost function.
         double cost();
@@ -488,6 +811,7 @@ namespace StimulusClampProtocol
         void save();
         void saveAs(QString filePath = "");
         void saveMonteCarloEventChainsAsDwt(QString filePath = "");
+        void saveSimulationsAsText(QString filePath = ""); // Tab delimited columns (same format as reference data).
         
     protected:
         // Properties.
@@ -498,11 +822,76 @@ namespace StimulusClampProtocol
         QString _weight;
         bool _startEquilibrated;
         QFileInfo _fileInfo;
+        
+        // Seed and model that the simulation random number seeds were last derived from.
+        uint64_t _randomSeed;
+        QPointer<MarkovModel::MarkovModel> _randomSeedModel;
     };
     
     /* --------------------------------------------------------------------------------
+     * Time spent in each stage of StimulusClampProtocolSimulator::runSimulation() and
+     * cost(), accumulated over all runs since initSimulation() (e.g. an optimization).
+     * - Stages run concurrently, so their times are summed over threads and may add up
+     *   to more than the wall time of runSimulation().
+     * - Each timed scope costs two steady clock reads and two relaxed atomic adds, so
+     *   profiling is always on.
      * -------------------------------------------------------------------------------- */
-    class StimulusClampProtocolSimulator : public QProgressDialog
+    struct SimulationProfile
+    {
+        enum Stage { RunSimulation, RateEvaluation, EigenDecomposition, MatrixExponentials, CellSimulation, EventChainSampling, Waveforms, Summaries, Cost, NumStages };
+        
+        std::atomic<long long> nsecs[NumStages];
+        std::atomic<long long> counts[NumStages];
+        
+        SimulationProfile() { clear(); }
+        
+        static QString stageName(int stage);
+        void clear();
+        void add(Stage stage, long long ns)
+        {
+            nsecs[stage].fetch_add(ns, std::memory_order_relaxed);
+            counts[stage].fetch_add(1, std::memory_order_relaxed);
+        }
+        double milliseconds(int stage) const { return nsecs[stage].load(std::memory_order_relaxed) * 1e-6; }
+        
+        QString toString() const; // e.g. "Rate evaluation 1.2 ms (4), Eigen decomposition 35 ms (4), ..." for stages that ran.
+        QVariantMap toVariantMap() const; // {stage: {"ms": time, "count": # of times run}}
+        
+        // Adds the time from construction (or restart()) until destruction (or stop()) to a stage.
+        class ScopedTimer
+        {
+        public:
+            ScopedTimer(SimulationProfile *profile, Stage stage) : _profile(profile), _stage(stage), _start(std::chrono::steady_clock::now()) {}
+            ~ScopedTimer() { stop(); }
+            void stop()
+            {
+                if(!_profile) return;
+                _profile->add(_stage, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+                _profile = 0;
+            }
+            void restart(SimulationProfile *profile, Stage stage)
+            {
+                stop();
+                _profile = profile;
+                _stage = stage;
+                _start = std::chrono::steady_clock::now();
+            }
+            
+        protected:
+            SimulationProfile *_profile;
+            Stage _stage;
+            std::chrono::steady_clock::time_point _start;
+        };
+    };
+    
+    /* --------------------------------------------------------------------------------
+     * Simulates/optimizes a model for a set of protocols.
+     * - No GUI. initSimulation()/runSimulation() and initOptimization()/runOptimization()
+     *   block the calling thread, with work distributed over QThreadPool::globalInstance(),
+     *   and throw std::runtime_error on failure.
+     * - Set abort to stop a running simulation/optimization from another thread.
+     * -------------------------------------------------------------------------------- */
+    class StimulusClampProtocolSimulator : public QObject
     {
         Q_OBJECT
         
@@ -514,7 +903,10 @@ namespace StimulusClampProtocol
         QVariantMap options;
         
         QStringList stateNames;
-        std::vector<Epoch*> uniqueEpochs;
+        std::vector<std::vector<Epoch*> > uniqueEpochs; // [variable set][unique epoch]
+        std::set<QString> modelExprSymbols; // Names referred to by the model's expressions.
+        MarkovModel::StateLumping stateLumping; // Equivalent states are simulated as one if reduced (and divided evenly afterwards).
+        SimulationProfile profile; // Cleared by initSimulation().
         AbortFlag abort;
         QString message;
         
@@ -526,38 +918,29 @@ namespace StimulusClampProtocol
         gsl_vector *dx; // Variable step sizes.
         gsl_multimin_function func;
         
-        StimulusClampProtocolSimulator(const QString &labelText = "", QWidget *parent = 0);
+        StimulusClampProtocolSimulator(QObject *parent = 0);
         ~StimulusClampProtocolSimulator();
         
         // [min, max) bounded coordinates <==> [-pi/2, pi/2).
         static double linear2angular(double val, double min, double max) { return asin(2 * (val - min) / (max - min) - 1); }
         static double angular2linear(double theta, double min, double max) { return min + (max - min) * (sin(theta)+1) / 2; }
         
-    public slots:
-        void simulate(bool showProgressDialog = true);
         void initSimulation();
         void runSimulation();
         
-        void optimize(size_t maxIterations, double tolerance = 0, bool showProgressDialog = true);
         void initOptimization();
         void runOptimization(size_t maxIterations, double tolerance = 0);
         double cost();
         
     signals:
-        void aborted();
-        void finished();
-        void iterationChanged(int);
-        
-    protected slots:
-        void _abort();
-        void _finish();
-        void _atIteration(int i) { setValue(i); }
+        void iterationChanged(int); // Emitted from the thread running the optimization.
         
     protected:
-        QFuture<void> _future;
-        QFutureWatcher<void> _watcher;
-        
-        void closeEvent(QCloseEvent *event) { _abort(); event->accept(); }
+        // Simulation stages (run as tasks by runSimulation).
+        void evalUniqueEpochs(size_t variableSetIndex, const QString &method, MarkovModel::MarkovModel::Evaluator &evaluator);
+        void evalSimulationWaveforms(StimulusClampProtocol *protocol, size_t row, size_t col, size_t variableSetIndex, const QString &method,
+                                     const MarkovModel::MarkovModel::ParameterMap &parameters, const QList<MarkovModel::StateGroup*> &stateGroups);
+        void normalizeSummaries(StimulusClampProtocol *protocol, size_t variableSetIndex);
     };
     
     /* --------------------------------------------------------------------------------
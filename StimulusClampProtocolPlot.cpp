@@ -204,7 +204,7 @@ namespace StimulusClampProtocol
                                 }
                                 if(yAxis == QwtPlot::yLeft && _showEventChains) {
                                     if(sim.events.size() > varSet) {
-                                        const std::vector<MonteCarloEventChain> &eventChains = sim.events.at(varSet);
+                                        const MonteCarloEventChains &eventChains = sim.events.at(varSet);
                                         std::vector<size_t> chainIndexes = visChains;
                                         if(chainIndexes.empty()) {
                                             chainIndexes.resize(eventChains.size());
@@ -214,15 +214,15 @@ namespace StimulusClampProtocol
                                         std::vector<double> eventStates;
                                         for(size_t visChain : chainIndexes) {
                                             if(visChain < eventChains.size()) {
-                                                const MonteCarloEventChain &eventChain = eventChains.at(visChain);
+                                                MonteCarloEventChains::Chain eventChain = eventChains.at(visChain);
                                                 eventTimes.resize(eventChain.size() + 1);
                                                 eventStates.resize(eventChain.size() + 1);
                                                 double cumTime = 0;
                                                 size_t eventCounter = 0;
-                                                for(const MonteCarloEvent &event : eventChain) {
+                                                for(size_t i = 0; i < eventChain.size(); ++i) {
                                                     eventTimes[eventCounter] = cumTime;
-                                                    eventStates[eventCounter] = event.state;
-                                                    cumTime += event.duration;
+                                                    eventStates[eventCounter] = eventChain.state(i);
+                                                    cumTime += eventChain.duration(i);
                                                     ++eventCounter;
                                                 }
                                                 eventTimes.back() = cumTime;
@@ -0,0 +1,84 @@
+/* --------------------------------------------------------------------------------
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "StimulusClampProtocolSimulatorDialog.h"
+#include <stdexcept>
+#include <QApplication>
+#include <QErrorMessage>
+#include <QTimer>
+#include <QtConcurrentRun>
+
+namespace StimulusClampProtocol
+{
+    StimulusClampProtocolSimulatorDialog::StimulusClampProtocolSimulatorDialog(const QString &labelText, QWidget *parent) :
+    QProgressDialog(labelText, "Abort", 0, 0, parent)
+    {
+        connect(this, SIGNAL(canceled()), this, SLOT(_abort()));
+        connect(&_watcher, SIGNAL(finished()), this, SLOT(_finish()));
+        connect(&simulator, SIGNAL(iterationChanged(int)), this, SLOT(_atIteration(int)));
+        setWindowModality(Qt::WindowModality::ApplicationModal);
+    }
+    
+    void StimulusClampProtocolSimulatorDialog::simulate(bool showProgressDialog)
+    {
+        setRange(0, 0); // Infinite wait progress bar.
+        if(showProgressDialog)
+            QTimer::singleShot(2000, this, SLOT(show())); // Show dialog after 2000 ms.
+        try {
+            simulator.initSimulation();
+            _future = QtConcurrent::run(&simulator, &StimulusClampProtocolSimulator::runSimulation);
+            _watcher.setFuture(_future);
+        } catch(std::runtime_error &e) {
+            simulator.message = QString(e.what());
+            _finish();
+        } catch(...) {
+            simulator.message = "Undocumented error.";
+            _finish();
+        }
+    }
+    
+    void StimulusClampProtocolSimulatorDialog::optimize(size_t maxIterations, double tolerance, bool showProgressDialog)
+    {
+        setRange(0, maxIterations); // Wait progress bar.
+        setValue(0);
+        if(showProgressDialog)
+            show();
+        try {
+            simulator.initOptimization();
+            _future = QtConcurrent::run(&simulator, &StimulusClampProtocolSimulator::runOptimization, maxIterations, tolerance);
+            _watcher.setFuture(_future);
+        } catch(std::runtime_error &e) {
+            simulator.message = QString(e.what());
+            _finish();
+        } catch(...) {
+            simulator.message = "Undocumented error.";
+            _finish();
+        }
+    }
+    
+    void StimulusClampProtocolSimulatorDialog::_abort()
+    {
+        simulator.abort = true;
+        emit aborted();
+        // Redraw dialog with "Aborting..." message.
+        setLabelText("Aborting...");
+        show();
+        QApplication::processEvents();
+    }
+    
+    void StimulusClampProtocolSimulatorDialog::_finish()
+    {
+        emit finished();
+        if(!simulator.message.isEmpty()) {
+            show();
+            QErrorMessage errMsg(this);
+            errMsg.showMessage(simulator.message);
+            errMsg.exec();
+        }
+        close();
+        deleteLater();
+    }
+
+} // StimulusClampProtocol
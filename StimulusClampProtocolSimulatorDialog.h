@@ -0,0 +1,61 @@
+/* --------------------------------------------------------------------------------
+ * Progress dialog for a StimulusClampProtocolSimulator (GUI only, the simulator
+ * itself has no widgets dependency).
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#ifndef __StimulusClampProtocolSimulatorDialog_H__
+#define __StimulusClampProtocolSimulatorDialog_H__
+
+#include "StimulusClampProtocol.h"
+#include <QCloseEvent>
+#include <QFuture>
+#include <QFutureWatcher>
+#include <QProgressDialog>
+#include <QString>
+#include <QWidget>
+#ifdef DEBUG
+#include <iostream>
+#include <QDebug>
+#endif
+
+namespace StimulusClampProtocol
+{
+    /* --------------------------------------------------------------------------------
+     * Progress dialog that runs its simulator in a separate thread.
+     * - Emits finished() and deletes itself when done, after showing any error message.
+     * -------------------------------------------------------------------------------- */
+    class StimulusClampProtocolSimulatorDialog : public QProgressDialog
+    {
+        Q_OBJECT
+        
+    public:
+        StimulusClampProtocolSimulator simulator;
+        
+        StimulusClampProtocolSimulatorDialog(const QString &labelText = "", QWidget *parent = 0);
+        
+    public slots:
+        void simulate(bool showProgressDialog = true);
+        void optimize(size_t maxIterations, double tolerance = 0, bool showProgressDialog = true);
+        
+    signals:
+        void aborted();
+        void finished();
+        
+    protected slots:
+        void _abort();
+        void _finish();
+        void _atIteration(int i) { setValue(i); }
+        
+    protected:
+        QFuture<void> _future;
+        QFutureWatcher<void> _watcher;
+        
+        void closeEvent(QCloseEvent *event) { _abort(); event->accept(); }
+    };
+    
+} // StimulusClampProtocol
+
+#endif
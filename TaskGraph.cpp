@@ -0,0 +1,113 @@
+/* --------------------------------------------------------------------------------
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "TaskGraph.h"
+#include <stdexcept>
+#include <QMutexLocker>
+
+TaskGraph::TaskGraph(QThreadPool *pool) :
+_pool(pool),
+_state(new State)
+{
+    _state->numUnfinishedTasks = 0;
+    _state->failed = false;
+}
+
+TaskGraph::TaskId TaskGraph::addTask(const std::function<void()> &func, const std::vector<TaskId> &dependencies)
+{
+    TaskId id = _state->tasks.size();
+    std::unique_ptr<Task> task(new Task);
+    task->func = func;
+    task->numPendingDependencies = int(dependencies.size());
+    for(TaskId dependency : dependencies) {
+        if(dependency >= id)
+            throw std::runtime_error("Task dependencies must be added before their dependents.");
+        _state->tasks.at(dependency)->dependents.push_back(id);
+    }
+    _state->tasks.push_back(std::move(task));
+    return id;
+}
+
+void TaskGraph::run()
+{
+    State &state = *_state;
+    {
+        QMutexLocker locker(&state.mutex);
+        state.numUnfinishedTasks = state.tasks.size();
+        state.failed = false;
+        state.errorMessage.clear();
+    }
+    // !!! Find all root tasks before starting any, as running tasks release their dependents.
+    std::vector<TaskId> rootTasks;
+    for(TaskId id = 0; id < state.tasks.size(); ++id) {
+        if(state.tasks.at(id)->numPendingDependencies == 0)
+            rootTasks.push_back(id);
+    }
+    for(TaskId id : rootTasks)
+        state.enqueue(id, _pool, _state);
+    // Help execute ready tasks until all tasks have finished.
+    while(true) {
+        if(state.runNextReadyTask(_pool, _state))
+            continue;
+        QMutexLocker locker(&state.mutex);
+        if(state.numUnfinishedTasks == 0)
+            break;
+        if(state.readyTasks.empty())
+            state.taskFinished.wait(&state.mutex);
+    }
+    if(state.failed)
+        throw std::runtime_error(state.errorMessage.toStdString());
+}
+
+void TaskGraph::State::enqueue(TaskId id, QThreadPool *pool, std::shared_ptr<State> self)
+{
+    {
+        QMutexLocker locker(&mutex);
+        readyTasks.push_back(id);
+        taskFinished.wakeAll();
+    }
+    pool->start(new Runner(pool, self));
+}
+
+bool TaskGraph::State::runNextReadyTask(QThreadPool *pool, std::shared_ptr<State> self)
+{
+    TaskId id;
+    bool skip;
+    {
+        QMutexLocker locker(&mutex);
+        if(readyTasks.empty())
+            return false;
+        id = readyTasks.front();
+        readyTasks.pop_front();
+        skip = failed;
+    }
+    Task &task = *tasks.at(id);
+    if(!skip) {
+        try {
+            task.func();
+        } catch(std::exception &e) {
+            QMutexLocker locker(&mutex);
+            if(!failed) {
+                failed = true;
+                errorMessage = QString(e.what());
+            }
+        } catch(...) {
+            QMutexLocker locker(&mutex);
+            if(!failed) {
+                failed = true;
+                errorMessage = "Undocumented error.";
+            }
+        }
+    }
+    // Dependents are still released after a failure so that the graph drains (their functions are skipped).
+    for(TaskId dependent : task.dependents) {
+        if(--tasks.at(dependent)->numPendingDependencies == 0)
+            enqueue(dependent, pool, self);
+    }
+    QMutexLocker locker(&mutex);
+    --numUnfinishedTasks;
+    taskFinished.wakeAll();
+    return true;
+}
@@ -0,0 +1,87 @@
+/* --------------------------------------------------------------------------------
+ * Dependency-aware task scheduler on a QThreadPool.
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#ifndef __TaskGraph_H__
+#define __TaskGraph_H__
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+#ifdef DEBUG
+#include <iostream>
+#include <QDebug>
+#endif
+
+/* --------------------------------------------------------------------------------
+ * Directed acyclic graph of tasks. Each task is started as soon as all of the tasks
+ * it depends on have finished, so independent stages are pipelined rather than
+ * separated by barriers.
+ * - Tasks must be added before run() is called, and dependencies must refer to
+ *   previously added tasks.
+ * - run() blocks until all tasks have finished. The calling thread also executes
+ *   ready tasks while it waits, so run() can safely be called from a pool thread.
+ * - If a task throws, the remaining tasks are skipped and run() rethrows the first
+ *   error as a std::runtime_error.
+ * - A graph can only be run once.
+ * -------------------------------------------------------------------------------- */
+class TaskGraph
+{
+public:
+    typedef size_t TaskId;
+
+    TaskGraph(QThreadPool *pool = QThreadPool::globalInstance());
+
+    TaskId addTask(const std::function<void()> &func, const std::vector<TaskId> &dependencies = std::vector<TaskId>());
+    size_t numTasks() const { return _state->tasks.size(); }
+
+    void run();
+
+protected:
+    struct Task
+    {
+        std::function<void()> func;
+        std::vector<TaskId> dependents;
+        std::atomic<int> numPendingDependencies;
+    };
+
+    // Shared with queued pool runnables, which may outlive the graph.
+    struct State
+    {
+        std::vector<std::unique_ptr<Task> > tasks;
+        std::deque<TaskId> readyTasks;
+        size_t numUnfinishedTasks;
+        bool failed;
+        QString errorMessage;
+        QMutex mutex;
+        QWaitCondition taskFinished;
+
+        bool runNextReadyTask(QThreadPool *pool, std::shared_ptr<State> self);
+        void enqueue(TaskId id, QThreadPool *pool, std::shared_ptr<State> self);
+    };
+
+    class Runner : public QRunnable
+    {
+    public:
+        Runner(QThreadPool *pool, std::shared_ptr<State> state) : _pool(pool), _state(state) {}
+        void run() { _state->runNextReadyTask(_pool, _state); }
+
+    protected:
+        QThreadPool *_pool;
+        std::shared_ptr<State> _state;
+    };
+
+    QThreadPool *_pool;
+    std::shared_ptr<State> _state;
+};
+
+#endif
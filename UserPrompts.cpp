@@ -0,0 +1,37 @@
+/* --------------------------------------------------------------------------------
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "UserPrompts.h"
+#include <iostream>
+
+namespace UserPrompts
+{
+    static FilePathPrompt openFileNamePrompt = 0;
+    static FilePathPrompt saveFileNamePrompt = 0;
+    static MessagePrompt errorMessagePrompt = 0;
+    
+    void setOpenFileNamePrompt(FilePathPrompt prompt) { openFileNamePrompt = prompt; }
+    void setSaveFileNamePrompt(FilePathPrompt prompt) { saveFileNamePrompt = prompt; }
+    void setErrorMessagePrompt(MessagePrompt prompt) { errorMessagePrompt = prompt; }
+    
+    QString getOpenFileName(const QString &caption, const QString &filePath)
+    {
+        return openFileNamePrompt ? openFileNamePrompt(caption, filePath) : QString();
+    }
+    
+    QString getSaveFileName(const QString &caption, const QString &filePath)
+    {
+        return saveFileNamePrompt ? saveFileNamePrompt(caption, filePath) : QString();
+    }
+    
+    void showErrorMessage(const QString &message)
+    {
+        if(errorMessagePrompt)
+            errorMessagePrompt(message);
+        else
+            std::cerr << "error: " << message.toStdString() << std::endl;
+    }
+    
+} // UserPrompts
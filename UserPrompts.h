@@ -0,0 +1,36 @@
+/* --------------------------------------------------------------------------------
+ * File path and error message prompts for the simulation engine.
+ *
+ * The engine (see KineticModelBuilder.pri) does not depend on QtWidgets so that it
+ * runs headless (e.g. kmb-cli, kmb-bench). Instead, the GUI installs its dialogs as
+ * prompts at startup. Without them, file paths are never asked for (an empty path is
+ * returned) and error messages are written to stderr.
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#ifndef __UserPrompts_H__
+#define __UserPrompts_H__
+
+#include <QString>
+
+namespace UserPrompts
+{
+    typedef QString (*FilePathPrompt)(const QString &caption, const QString &filePath);
+    typedef void (*MessagePrompt)(const QString &message);
+    
+    // Install prompts (zero restores the default). Not thread safe, set them before any prompt is used.
+    void setOpenFileNamePrompt(FilePathPrompt prompt);
+    void setSaveFileNamePrompt(FilePathPrompt prompt);
+    void setErrorMessagePrompt(MessagePrompt prompt);
+    
+    // Ask for a file path (empty if canceled or there are no prompts).
+    QString getOpenFileName(const QString &caption, const QString &filePath = "");
+    QString getSaveFileName(const QString &caption, const QString &filePath = "");
+    
+    void showErrorMessage(const QString &message);
+    
+} // UserPrompts
+
+#endif
@@ -0,0 +1,252 @@
+/* --------------------------------------------------------------------------------
+ * Simulation engine benchmarks on reproducible synthetic models and protocols.
+ *
+ * Models (all rates depend on a voltage stimulus V):
+ * - Linear chain of N states.
+ * - Fully connected graph of N states.
+ * - N binary elements with nearest neighbor interactions (2^N states).
+ *
+ * Protocols vary the # of sweeps (rows of V step amplitudes), the # of V pulses per
+ * sweep (epochs) and the # of sample points per sweep.
+ *
+ * Each benchmark reports the min and median wall time over several repeats (ms) as
+ * tab delimited columns, so that results from different builds or machines can be
+ * compared directly (e.g. to catch regressions or to size hardware).
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "MarkovModel.h"
+#include "StimulusClampProtocol.h"
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThreadPool>
+
+struct ModelSpec
+{
+    QString type; // "chain", "full" or "binary"
+    int size; // # of states, or # of binary elements.
+};
+
+struct ProtocolSpec
+{
+    int numSweeps;
+    int numPulses; // Per sweep (2 epochs each).
+    int numSamples; // Per sweep.
+};
+
+static QString modelName(const ModelSpec &spec) { return spec.type + QString::number(spec.size); }
+
+// All states in a group "Open" with conductance g, so that every model has the same waveforms.
+static void newModel(MarkovModel::MarkovModel *model, const ModelSpec &spec)
+{
+    new MarkovModel::Variable(model, "a", "0.5");
+    new MarkovModel::Variable(model, "b", "0.2");
+    new MarkovModel::Variable(model, "c", "2");
+    QString openStates;
+    if(spec.type == "binary") {
+        std::vector<MarkovModel::BinaryElement*> elements;
+        for(int i = 0; i < spec.size; ++i) {
+            MarkovModel::BinaryElement *element = new MarkovModel::BinaryElement(model, "E" + QString::number(i));
+            element->setRate01("a*exp(V/50)");
+            element->setRate10("b*exp(-V/50)");
+            elements.push_back(element);
+        }
+        for(int i = 0; i + 1 < spec.size; ++i) {
+            MarkovModel::Interaction *interaction = new MarkovModel::Interaction(model, elements.at(i), elements.at(i + 1));
+            interaction->setFactor11("c");
+            interaction->setFactorA1("sqrt(c)");
+        }
+        openStates = QString(spec.size, '1');
+    } else {
+        std::vector<MarkovModel::State*> states;
+        for(int i = 0; i < spec.size; ++i)
+            states.push_back(new MarkovModel::State(model, "S" + QString::number(i)));
+        states.front()->setProbability("1");
+        for(int i = 0; i < spec.size; ++i) {
+            for(int j = 0; j < spec.size; ++j) {
+                if(i == j || (spec.type == "chain" && std::abs(i - j) != 1))
+                    continue;
+                // Deterministic rate scale factors in [0.2, 2].
+                QString scale = QString::number(0.2 * (1 + (7 * i + 13 * j) % 10));
+                MarkovModel::Transition *transition = new MarkovModel::Transition(model, states.at(i), states.at(j));
+                transition->setRate(scale + (i < j ? "*a*exp(V/50)" : "*b*exp(-V/50)"));
+            }
+        }
+        openStates = states.back()->name();
+    }
+    MarkovModel::StateGroup *open = new MarkovModel::StateGroup(model, "Open", openStates);
+    open->setAttributes("g: 1");
+}
+
+// Sweeps step V from -100 to 100 mV, each sweep being a train of pulses within a 100 ms record.
+static void newProtocol(StimulusClampProtocol::StimulusClampProtocol *protocol, const ProtocolSpec &spec)
+{
+    const double duration = 100;
+    const double pulsePeriod = 0.8 * duration / spec.numPulses;
+    QStringList amplitudes;
+    for(int i = 0; i < spec.numSweeps; ++i)
+        amplitudes << QString::number(spec.numSweeps > 1 ? -100 + 200.0 * i / (spec.numSweeps - 1) : 0);
+    protocol->setStart("0");
+    protocol->setDuration(QString::number(duration));
+    protocol->setSampleInterval(QString::number(duration / spec.numSamples, 'g', 12));
+    StimulusClampProtocol::Stimulus *stimulus = new StimulusClampProtocol::Stimulus(protocol, "V");
+    stimulus->setStart(QString::number(0.1 * duration));
+    stimulus->setDuration(QString::number(pulsePeriod / 2, 'g', 12));
+    stimulus->setAmplitude(amplitudes.join(";"));
+    stimulus->setRepetitions(QString::number(spec.numPulses));
+    stimulus->setPeriod(QString::number(pulsePeriod, 'g', 12));
+    StimulusClampProtocol::Waveform *waveform = new StimulusClampProtocol::Waveform(protocol, "I");
+    waveform->setExpr("g .* (V + 80)");
+    StimulusClampProtocol::SimulationsSummary *summary = new StimulusClampProtocol::SimulationsSummary(protocol, "IV");
+    summary->setExprX("mean(V)");
+    summary->setExprY("mean(I)");
+    summary->setStartX(QString::number(0.1 * duration));
+    summary->setDurationX(QString::number(pulsePeriod / 2, 'g', 12));
+    summary->setStartY(QString::number(0.1 * duration));
+    summary->setDurationY(QString::number(pulsePeriod / 2, 'g', 12));
+}
+
+// Min and median of repeated runs of func (ms). setup is run untimed before each repeat.
+static void benchmark(const QString &caseName, const QString &benchmarkName, int numRepeats, std::function<void()> func, std::function<void()> setup = std::function<void()>())
+{
+    std::vector<double> times;
+    QElapsedTimer timer;
+    for(int i = 0; i < numRepeats; ++i) {
+        if(setup)
+            setup();
+        timer.start();
+        func();
+        times.push_back(timer.nsecsElapsed() * 1e-6);
+    }
+    std::sort(times.begin(), times.end());
+    std::cout << caseName.toStdString() << "\t" << benchmarkName.toStdString() << "\t" << times.front() << "\t" << times.at(times.size() / 2) << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("kmb-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark the simulation engines on synthetic models and protocols.");
+    parser.addHelpOption();
+    QCommandLineOption repeatsOption(QStringList() << "r" << "repeats", "# of repeats of each benchmark (default 5).", "n", "5");
+    QCommandLineOption runsOption(QStringList() << "runs", "# of Monte Carlo runs per simulation (default 100).", "n", "100");
+    QCommandLineOption threadsOption(QStringList() << "t" << "threads", "# of threads (default is the # of cores).", "n");
+    QCommandLineOption filterOption(QStringList() << "f" << "filter", "Only run cases or benchmarks whose name contains this string.", "str");
+    QCommandLineOption quickOption(QStringList() << "quick", "Only the smallest models and protocols.");
+    parser.addOption(repeatsOption);
+    parser.addOption(runsOption);
+    parser.addOption(threadsOption);
+    parser.addOption(filterOption);
+    parser.addOption(quickOption);
+    parser.process(app);
+    int numRepeats = std::max(1, parser.value(repeatsOption).toInt());
+    int numRuns = std::max(1, parser.value(runsOption).toInt());
+    QString filter = parser.value(filterOption);
+    if(parser.isSet(threadsOption) && parser.value(threadsOption).toInt() > 0)
+        QThreadPool::globalInstance()->setMaxThreadCount(parser.value(threadsOption).toInt());
+
+    std::vector<ModelSpec> models = {{"chain", 4}, {"chain", 16}, {"chain", 64}, {"full", 8}, {"full", 32}, {"binary", 3}, {"binary", 6}};
+    std::vector<ProtocolSpec> protocols = {{1, 1, 1000}, {16, 1, 1000}, {16, 8, 1000}, {16, 1, 10000}};
+    if(parser.isSet(quickOption)) {
+        models = {{"chain", 4}, {"full", 8}, {"binary", 3}};
+        protocols = {{1, 1, 1000}, {16, 8, 1000}};
+    }
+
+    std::cout << "# threads: " << QThreadPool::globalInstance()->maxThreadCount() << ", repeats: " << numRepeats << ", Monte Carlo runs: " << numRuns << std::endl;
+    std::cout << "case\tbenchmark\tmin (ms)\tmedian (ms)" << std::endl;
+    try {
+        for(const ModelSpec &modelSpec : models) {
+            for(const ProtocolSpec &protocolSpec : protocols) {
+                // e.g. chain16 x16 sweeps x8 pulses x1000 samples
+                QString caseName = modelName(modelSpec) + " x" + QString::number(protocolSpec.numSweeps) + " sweeps x" + QString::number(protocolSpec.numPulses)
+                + " pulses x" + QString::number(protocolSpec.numSamples) + " samples";
+                MarkovModel::MarkovModel model;
+                newModel(&model, modelSpec);
+                StimulusClampProtocol::StimulusClampProtocol protocol;
+                newProtocol(&protocol, protocolSpec);
+                StimulusClampProtocol::StimulusClampProtocolSimulator simulator;
+                simulator.model = &model;
+                simulator.protocols.push_back(&protocol);
+                simulator.options["Random seed"] = 0;
+                simulator.options["# Monte Carlo runs"] = numRuns;
+                simulator.options["# Channels"] = 1000;
+                auto isSelected = [&](const QString &benchmarkName) { return filter.isEmpty() || caseName.contains(filter) || benchmarkName.contains(filter); };
+                auto forEachSimulation = [&](std::function<void(StimulusClampProtocol::Simulation&)> func) {
+                    for(std::vector<StimulusClampProtocol::Simulation> &simulationsRow : protocol.simulations) {
+                        for(StimulusClampProtocol::Simulation &sim : simulationsRow)
+                            func(sim);
+                    }
+                };
+                auto startingProbability = [](const StimulusClampProtocol::Simulation &sim) { return sim.epochs.begin()->uniqueEpochs[0]->stateProbabilities; };
+
+                // Full simulations (rates, spectra/propagators, simulations, waveforms and summaries from scratch).
+                for(const QString &method : QStringList() << "Eigen Solver" << "Matrix Exponential" << "Krylov Subspace" << "Monte Carlo" << "Stochastic Ensemble") {
+                    QString benchmarkName = "runSimulation (" + method + ")";
+                    if(!isSelected(benchmarkName))
+                        continue;
+                    simulator.options["Method"] = method;
+                    benchmark(caseName, benchmarkName, numRepeats, [&]() { simulator.runSimulation(); }, [&]() { simulator.initSimulation(); });
+                }
+
+                // Kernels (serially over all simulations of the first variable set, after a full simulation to set up their inputs).
+                if(isSelected("spectralExpansion") || isSelected("spectralSimulation")) {
+                    simulator.options["Method"] = "Eigen Solver";
+                    simulator.initSimulation();
+                    simulator.runSimulation();
+                    if(isSelected("spectralExpansion")) {
+                        benchmark(caseName, "spectralExpansion", numRepeats, [&]() {
+                            Eigen::VectorXd eigenValues;
+                            Eigen::MatrixXd eigenVectors, inverseEigenVectors;
+                            for(StimulusClampProtocol::Epoch *epoch : simulator.uniqueEpochs.at(0))
+                                StimulusClampProtocol::spectralExpansion(epoch->transitionRates, eigenValues, eigenVectors, inverseEigenVectors);
+                        });
+                    }
+                    if(isSelected("spectralSimulation")) {
+                        benchmark(caseName, "spectralSimulation", numRepeats, [&]() {
+                            forEachSimulation([&](StimulusClampProtocol::Simulation &sim) { sim.spectralSimulation(startingProbability(sim)); });
+                        });
+                    }
+                }
+                if(isSelected("monteCarloSimulation") || isSelected("getProbabilityFromEventChains")) {
+                    simulator.options["Method"] = "Monte Carlo";
+                    simulator.initSimulation();
+                    simulator.runSimulation();
+                    if(isSelected("monteCarloSimulation")) {
+                        benchmark(caseName, "monteCarloSimulation", numRepeats, [&]() {
+                            forEachSimulation([&](StimulusClampProtocol::Simulation &sim) {
+                                uint64_t seed = sim.randomSeeds.at(0);
+                                sim.monteCarloSimulation(startingProbability(sim), seed, numRuns);
+                            });
+                        });
+                    }
+                    if(isSelected("getProbabilityFromEventChains")) {
+                        int numStates = simulator.stateNames.size();
+                        benchmark(caseName, "getProbabilityFromEventChains", numRepeats, [&]() {
+                            forEachSimulation([&](StimulusClampProtocol::Simulation &sim) {
+                                Eigen::MatrixXd P;
+                                sim.getProbabilityFromEventChains(P, numStates, sim.events.at(0));
+                            });
+                        });
+                    }
+                }
+            } // protocolSpec
+        } // modelSpec
+    } catch(std::runtime_error &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    } catch(...) {
+        std::cerr << "error: Undocumented error." << std::endl;
+        return 1;
+    }
+    return 0;
+}
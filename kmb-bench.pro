@@ -0,0 +1,20 @@
+TARGET = kmb-bench
+TEMPLATE = app
+QT += core gui concurrent
+
+CONFIG += console
+CONFIG -= app_bundle
+
+#release: DESTDIR = Release
+release: OBJECTS_DIR = Release/.obj-bench
+release: MOC_DIR = Release/.moc-bench
+
+#debug: DESTDIR = Debug
+debug: OBJECTS_DIR = Debug/.obj-bench
+debug: MOC_DIR = Debug/.moc-bench
+
+# User defined paths, settings and simulation engine files.
+include(KineticModelBuilder.pri)
+
+# Files
+SOURCES += kmb-bench.cpp
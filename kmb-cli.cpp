@@ -0,0 +1,195 @@
+/* --------------------------------------------------------------------------------
+ * Headless command line batch runner (no GUI or X server required).
+ *
+ * Loads a project file (as saved by the GUI), simulates or optimizes one of its
+ * models for all of its stimulus clamp protocols, and writes the results to disk:
+ * - <output>/<protocol> (set,row,col).txt and <output>/<protocol> <summary> (set).txt
+ *   (see StimulusClampProtocol::saveSimulationsAsText).
+ * - <output>/<model>.json for the optimized model.
+ * - Optionally, the time spent in each simulation stage as JSON (see SimulationProfile).
+ *
+ * Author: Marcel Paz Goldschen-Ohm
+ * Email: marcel.goldschen@gmail.com
+ * -------------------------------------------------------------------------------- */
+
+#include "MarkovModel.h"
+#include "QObjectPropertyTreeSerializer.h"
+#include "StimulusClampProtocol.h"
+#include <iostream>
+#include <stdexcept>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QVariantList>
+#include <QVariantMap>
+
+// Project child objects of the given class (stored as a single map or a list of maps).
+static QList<QVariantMap> childData(const QVariantMap &data, const QString &className)
+{
+    QList<QVariantMap> children;
+    if(data.value(className).type() == QVariant::List) {
+        foreach(const QVariant &node, data.value(className).toList()) {
+            if(node.type() == QVariant::Map)
+                children.push_back(node.toMap());
+        }
+    } else if(data.value(className).type() == QVariant::Map) {
+        children.push_back(data.value(className).toMap());
+    }
+    return children;
+}
+
+// Simulator options from the project's simulation options (see KineticModelBuilder::Project).
+static QVariantMap simulationOptions(const QVariantMap &data, const QString &method)
+{
+    QVariantMap options;
+    options["Method"] = method;
+    if(method == "Monte Carlo") {
+        options["# Monte Carlo runs"] = data.value("NumberOfMonteCarloRuns", 1000).toInt();
+        options["Accumulate Monte Carlo runs"] = data.value("AccumulateMonteCarloRuns", false).toBool();
+        options["Sample probability from Monte Carlo event chains"] = data.value("SampleMonteCarloProbability", true).toBool();
+        options["# Monte Carlo event chains to keep"] = data.value("NumberOfMonteCarloEventChainsToKeep", -1).toInt();
+    } else if(method == "Stochastic Ensemble") {
+        options["# Channels"] = data.value("NumberOfEnsembleChannels", 1000).toInt();
+    }
+    options["Random seed"] = data.value("RandomSeed", -1).toLongLong();
+    options["Lump equivalent states"] = data.value("LumpEquivalentStates", false).toBool();
+    return options;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("kmb-cli");
+
+    // Same order as KineticModelBuilder::Project::SimulationMethod.
+    QStringList methods = QStringList() << "Eigen Solver" << "Monte Carlo" << "Matrix Exponential" << "Krylov Subspace" << "Stochastic Ensemble";
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Simulate or optimize a Kinetic Model Builder project without the GUI.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("project", "Project file (.json).");
+    QCommandLineOption modelOption(QStringList() << "m" << "model", "Name of the model to simulate (default is the first model).", "name");
+    QCommandLineOption optimizeOption(QStringList() << "optimize", "Optimize the model's free variables.");
+    QCommandLineOption iterationsOption(QStringList() << "iterations", "Maximum # of optimization iterations (default from project).", "n");
+    QCommandLineOption toleranceOption(QStringList() << "tolerance", "Optimization tolerance (default 0).", "tol", "0");
+    QCommandLineOption methodOption(QStringList() << "method", "Simulation method (default from project): " + methods.join(", ") + ".", "method");
+    QCommandLineOption seedOption(QStringList() << "seed", "Random seed (default from project, negative for nondeterministic).", "seed");
+    QCommandLineOption threadsOption(QStringList() << "t" << "threads", "# of threads (default is the # of cores).", "n");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Output directory (default is the current directory).", "dir", ".");
+    QCommandLineOption profileOption(QStringList() << "profile", "Save the time spent in each simulation stage to a JSON file.", "file");
+    parser.addOption(modelOption);
+    parser.addOption(optimizeOption);
+    parser.addOption(iterationsOption);
+    parser.addOption(toleranceOption);
+    parser.addOption(methodOption);
+    parser.addOption(seedOption);
+    parser.addOption(threadsOption);
+    parser.addOption(outputOption);
+    parser.addOption(profileOption);
+    parser.process(app);
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    try {
+        // Project.
+        QString filePath = parser.positionalArguments().at(0);
+        QFile file(filePath);
+        if(!file.open(QIODevice::Text | QIODevice::ReadOnly))
+            throw std::runtime_error("Failed to open '" + filePath.toStdString() + "'.");
+        QVariantMap data = QJsonDocument::fromJson(file.readAll()).toVariant().toMap();
+        file.close();
+        if(data.isEmpty())
+            throw std::runtime_error("Invalid project file '" + filePath.toStdString() + "'.");
+        QFileInfo fileInfo(filePath);
+        QObject project;
+
+        // Model.
+        MarkovModel::MarkovModel *model = 0;
+        foreach(const QVariantMap &modelData, childData(data, "MarkovModel::MarkovModel")) {
+            MarkovModel::MarkovModel *candidate = new MarkovModel::MarkovModel(&project);
+            candidate->setFileInfo(fileInfo);
+            candidate->clear();
+            QObjectPropertyTreeSerializer::deserialize(candidate, modelData, &MarkovModel::MarkovModel::objectFactory);
+            if(!model && (!parser.isSet(modelOption) || candidate->name() == parser.value(modelOption)))
+                model = candidate;
+        }
+        if(!model)
+            throw std::runtime_error("No model" + (parser.isSet(modelOption) ? " named '" + parser.value(modelOption).toStdString() + "'" : std::string()) + ".");
+
+        // Protocols.
+        StimulusClampProtocol::StimulusClampProtocolSimulator simulator;
+        foreach(const QVariantMap &protocolData, childData(data, "StimulusClampProtocol::StimulusClampProtocol")) {
+            StimulusClampProtocol::StimulusClampProtocol *protocol = new StimulusClampProtocol::StimulusClampProtocol(&project);
+            protocol->setFileInfo(fileInfo);
+            protocol->clear();
+            QObjectPropertyTreeSerializer::deserialize(protocol, protocolData, &StimulusClampProtocol::StimulusClampProtocol::objectFactory);
+            simulator.protocols.push_back(protocol);
+        }
+        if(simulator.protocols.empty())
+            throw std::runtime_error("No stimulus clamp protocols.");
+
+        // Options.
+        QString method = methods.value(data.value("SimulationMethod", 1).toInt(), "Monte Carlo");
+        if(methods.contains(data.value("SimulationMethod").toString()))
+            method = data.value("SimulationMethod").toString();
+        if(parser.isSet(methodOption)) {
+            method = parser.value(methodOption);
+            if(!methods.contains(method))
+                throw std::runtime_error("Unknown simulation method '" + method.toStdString() + "'.");
+        }
+        simulator.model = model;
+        simulator.options = simulationOptions(data, method);
+        if(parser.isSet(seedOption))
+            simulator.options["Random seed"] = parser.value(seedOption).toLongLong();
+        if(parser.isSet(threadsOption) && parser.value(threadsOption).toInt() > 0)
+            QThreadPool::globalInstance()->setMaxThreadCount(parser.value(threadsOption).toInt());
+
+        // Simulate/Optimize.
+        QElapsedTimer timer;
+        timer.start();
+        if(parser.isSet(optimizeOption)) {
+            size_t maxIterations = parser.isSet(iterationsOption) ? parser.value(iterationsOption).toUInt() : data.value("NumberOfOptimizationIterations", 100).toUInt();
+            QObject::connect(&simulator, &StimulusClampProtocol::StimulusClampProtocolSimulator::iterationChanged, [](int i) { std::cout << "Iteration " << i << std::endl; });
+            simulator.initOptimization();
+            simulator.runOptimization(maxIterations, parser.value(toleranceOption).toDouble());
+        } else {
+            simulator.initSimulation();
+            simulator.runSimulation();
+        }
+        std::cout << "Cost: " << simulator.cost() << std::endl;
+        std::cout << "Elapsed time: " << timer.elapsed() / 1000.0 << " sec" << std::endl;
+        std::cout << "Profile: " << simulator.profile.toString().toStdString() << std::endl;
+
+        // Results.
+        QDir outputDir(parser.value(outputOption));
+        if(!outputDir.mkpath("."))
+            throw std::runtime_error("Failed to create output directory '" + outputDir.path().toStdString() + "'.");
+        for(size_t i = 0; i < simulator.protocols.size(); ++i) {
+            StimulusClampProtocol::StimulusClampProtocol *protocol = simulator.protocols.at(i);
+            QString name = protocol->name().isEmpty() ? "Protocol " + QString::number(i) : protocol->name();
+            protocol->saveSimulationsAsText(outputDir.filePath(name));
+        }
+        if(parser.isSet(profileOption)) {
+            QFile profileFile(parser.value(profileOption));
+            if(!profileFile.open(QIODevice::Text | QIODevice::WriteOnly))
+                throw std::runtime_error("Failed to open '" + profileFile.fileName().toStdString() + "'.");
+            QTextStream out(&profileFile);
+            out << QJsonDocument::fromVariant(simulator.profile.toVariantMap()).toJson(QJsonDocument::Indented);
+            profileFile.close();
+        }
+        if(parser.isSet(optimizeOption))
+            model->saveAs(outputDir.filePath((model->name().isEmpty() ? "Model" : model->name()) + ".json"));
+    } catch(std::runtime_error &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    } catch(...) {
+        std::cerr << "error: Undocumented error." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,20 @@
+TARGET = kmb-cli
+TEMPLATE = app
+QT += core gui concurrent
+
+CONFIG += console
+CONFIG -= app_bundle
+
+#release: DESTDIR = Release
+release: OBJECTS_DIR = Release/.obj-cli
+release: MOC_DIR = Release/.moc-cli
+
+#debug: DESTDIR = Debug
+debug: OBJECTS_DIR = Debug/.obj-cli
+debug: MOC_DIR = Debug/.moc-cli
+
+# User defined paths, settings and simulation engine files.
+include(KineticModelBuilder.pri)
+
+# Files
+SOURCES += kmb-cli.cpp
@@ -1,5 +1,8 @@
 #include <QApplication>
+#include <QFileDialog>
+#include <QMessageBox>
 #include "Project.h"
+#include "UserPrompts.h"
 #ifdef DEBUG
 #include <iostream>
 #include <QDebug>
@@ -9,6 +12,11 @@ int main(int argc, char **argv)
 {
     QApplication app(argc, argv);
     
+    // Dialogs for the simulation engine's file path and error message prompts.
+    UserPrompts::setOpenFileNamePrompt([](const QString &caption, const QString &filePath) { return QFileDialog::getOpenFileName(0, caption, filePath); });
+    UserPrompts::setSaveFileNamePrompt([](const QString &caption, const QString &filePath) { return QFileDialog::getSaveFileName(0, caption, filePath); });
+    UserPrompts::setErrorMessagePrompt([](const QString &message) { QMessageBox::information(0, "error", message); });
+    
     KineticModelBuilder::Project project;
     project.newMarkovModel();
     project.newStimulusClampProtocol();